@@ -1,39 +1,94 @@
-/************************************************************************/ 
+/************************************************************************/
 /*	 Maximilian Schroeder  												*/
 /*																		*/
-/*   PROGRAM NAME: client.c  (works with server.c)						*/ 
-/*                                                                      */ 
-/*   Client creates a socket to connect to Server.                      */ 
-/*   When the communication established, Client writes data to server   */ 
-/*   and echoes the response from Server.                               */ 
-/*                                                                      */ 
-/*   To run this program, first compile the server.c and run it			*/ 
-/*   on a server machine. Then run the client program on another        */ 
-/*   machine.                                                           */ 
-/*                                                                      */ 
-/*   COMPILE:    gcc -pthread -o client client.c                        */
-/*   TO RUN:     client <server name> <port no>							*/ 
-/*                                                                      */ 
-/************************************************************************/ 
+/*   PROGRAM NAME: client.c  (works with server.c)						*/
+/*                                                                      */
+/*   Client creates a socket to connect to Server.                      */
+/*   When the communication established, Client writes data to server   */
+/*   and echoes the response from Server. Messages are sent as          */
+/*   length-prefixed frames (see protocol.h).                           */
+/*                                                                      */
+/*   A single poll loop serves the keyboard (or a pipe or file on       */
+/*   stdin) and the socket. Every line read is queued as a frame, and   */
+/*   all queued frames go out with one write, so scripted input is sent */
+/*   as fast as the server takes it. The first line is the username     */
+/*   unless it is given with -u. When stdin ends, the client sends what */
+/*   is queued and exits once the server has closed the connection.     */
+/*   If the connection is lost, the client reconnects with a growing    */
+/*   delay, sends its username again and sends the lines it had not yet */
+/*   written, including one cut off mid-write. Lines already handed to  */
+/*   the socket count as sent: without acknowledgements from the server,*/
+/*   those still in the kernel's buffer when the connection drops are   */
+/*   lost.                                                              */
+/*                                                                      */
+/*   To run this program, first compile the server.c and run it			*/
+/*   on a server machine. Then run the client program on another        */
+/*   machine.                                                           */
+/*                                                                      */
+/*   COMPILE:    gcc -o client client.c                                 */
+/*   TO RUN:     client [options] <server name> <port no>               */
+/*                                                                      */
+/*   OPTIONS:    -u <name>   username (default: first line of stdin)    */
+/*               -n          exit instead of reconnecting when the      */
+/*                           connection is lost                         */
+/*                                                                      */
+/************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/types.h> 
-#include <sys/socket.h>  /* define socket */ 
-#include <netinet/in.h>  /* define internet socket */ 
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>        /* define poll */
+#include <sys/types.h>
+#include <sys/socket.h>  /* define socket */
+#include <netinet/in.h>  /* define internet socket */
 #include <netdb.h>       /* define internet socket */
-#include <pthread.h>     /* define pthread */
+#include <unistd.h>
+#include "protocol.h"    /* define wire protocol */
 
-#define MAX_BUFFER_SIZE 512
+#define MAX_USERNAME 99				/* define max length of a username */
+#define READ_SIZE 65536				/* define max bytes read from stdin or the socket at once */
+#define MAX_PENDING 1048576			/* define bytes of queued frames at which stdin is no longer read */
+#define BACKOFF_MIN 500				/* define ms before the first attempt to reconnect */
+#define BACKOFF_MAX 30000			/* define max ms between attempts to reconnect */
 
-// struct of client data passed to reader thread
+// connection states
+#define CONN_WAITING 0				/* no connection, waiting to reconnect */
+#define CONN_CONNECTING 1			/* connect in progress */
+#define CONN_HANDSHAKE 2			/* connected, waiting for the server to accept */
+#define CONN_ACCEPTED 3				/* accepted, waiting for the username to be entered */
+#define CONN_ACTIVE 4				/* username sent, chatting */
+
+// growable byte buffer
+struct buffer
+{
+	char * data;						/* bytes */
+	size_t len;							/* amount of bytes in data */
+	size_t size;						/* allocated length of data */
+};
+
+// state of the client and its connection
 struct clientData
 {
-	int client_fd;						/* client FD */
+	int client_fd;						/* client FD, -1 if not connected */
+	int state;							/* connection state (CONN_*) */
 	struct sockaddr_in server_addr;		/* server address */
-	char * username;                    /* client username */
+	char username[MAX_USERNAME + 1];	/* client username */
+	int has_username;					/* true once username is known */
+	int reconnect;						/* true to reconnect when the connection is lost */
+	int backoff;						/* ms to wait before the next attempt to reconnect */
+	uint64_t next_attempt;				/* time of the next attempt to connect (ns) */
+	int input_open;						/* true until stdin ends */
+	int truncating;						/* true while dropping the rest of a line longer than a frame */
+	int write_closed;					/* true once the sending side of the socket is shut down */
+	int accepted_once;					/* true once any connection was accepted */
+	struct buffer input;				/* bytes read from stdin that do not form a full line yet */
+	struct buffer out;					/* frames to send, starting at a frame boundary */
+	size_t out_sent;					/* bytes of out written to the current connection */
+	struct buffer in;					/* bytes received from the server that do not form a full frame yet */
 };
 
 // signal handler to catch SIGINT
@@ -42,142 +97,401 @@ void sigHandler(int signal)
 	fprintf(stderr, "[CLIENT] Ctrl+C detected. Please use '/exit', '/part', or '/quit' to exit the program.\n");
 }
 
-// function used by reader thread to read incoming messages from server
-void * reader(void * arg)
-{
-	// get clientData struct from arg
-	struct clientData * client_info = (struct clientData *)arg;
-	
-	// initialize buffer
-	char buffer[MAX_BUFFER_SIZE];
-	
-	// read data from socket
-	while (read(client_info->client_fd, &buffer, sizeof(buffer)) > 0)
+// prints an error message to the console, then closes the program
+void error(char * message)
+{
+	fprintf(stderr, "%s", message);
+	exit(1);
+}
+
+// returns the current time of the monotonic clock in nanoseconds
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// makes room for extra more bytes in the buffer; exits if memory runs out
+void reserveBuffer(struct buffer * buffer, size_t extra)
+{
+	if (buffer->len + extra <= buffer->size)
+		return;
+	size_t new_size = buffer->size ? buffer->size : 4096;
+	while (new_size < buffer->len + extra)
+		new_size *= 2;
+	char * data = realloc(buffer->data, new_size);
+	if (data == NULL)
+		error("[CLIENT] ERROR: Out of memory.\n");
+	buffer->data = data;
+	buffer->size = new_size;
+}
+
+// removes the first len bytes of the buffer
+void consumeBuffer(struct buffer * buffer, size_t len)
+{
+	memmove(buffer->data, buffer->data + len, buffer->len - len);
+	buffer->len -= len;
+}
+
+// appends a frame of the specified type and payload to the frames to send
+void queueFrame(struct clientData * client, int type, const char * payload, uint32_t len)
+{
+	reserveBuffer(&client->out, FRAME_HEADER_SIZE + len);
+	encodeFrameHeader((unsigned char *)client->out.data + client->out.len, type, len);
+	memcpy(client->out.data + client->out.len + FRAME_HEADER_SIZE, payload, len);
+	client->out.len += FRAME_HEADER_SIZE + len;
+}
+
+// puts the username frame in front of the queued frames once the server accepted and the username is known
+void sendUsername(struct clientData * client)
+{
+	int len = strlen(client->username);
+	if (client->state != CONN_ACCEPTED || !client->has_username)
+		return;
+	reserveBuffer(&client->out, FRAME_HEADER_SIZE + len);
+	memmove(client->out.data + FRAME_HEADER_SIZE + len, client->out.data, client->out.len);
+	encodeFrameHeader((unsigned char *)client->out.data, FRAME_USERNAME, len);
+	memcpy(client->out.data + FRAME_HEADER_SIZE, client->username, len);
+	client->out.len += FRAME_HEADER_SIZE + len;
+	client->state = CONN_ACTIVE;
+}
+
+// handles one line of input: the username if it is not known yet, else a chat message
+void handleLine(struct clientData * client, char * line, size_t len)
+{
+	// strip terminating characters
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+	if (!client->has_username)
 	{
-		// check message received from server, perform special action if it is a command
-		if (strncmp(buffer, "-SERVER KILL-", sizeof(buffer)) == 0)
+		if (len > MAX_USERNAME)
+			len = MAX_USERNAME;
+		memcpy(client->username, line, len);
+		client->username[len] = '\0';
+		client->has_username = 1;
+		sendUsername(client);
+	}
+	else if (len > 0)
+		queueFrame(client, FRAME_TEXT, line, len);
+}
+
+// reads what stdin has and queues every full line; a line longer than a frame is cut, a last line without a
+// newline is sent when stdin ends
+void readInput(struct clientData * client)
+{
+	size_t start = 0;
+	size_t i;
+	reserveBuffer(&client->input, READ_SIZE);
+	ssize_t n = read(STDIN_FILENO, client->input.data + client->input.len, READ_SIZE);
+	if (n == -1 && errno == EINTR)
+		return;
+	if (n <= 0)
+	{
+		if (client->input.len > 0 && !client->truncating)
+			handleLine(client, client->input.data, client->input.len);
+		client->input.len = 0;
+		client->input_open = 0;
+		return;
+	}
+
+	// look for newlines in the bytes just read only; what is before them was searched already
+	for (i = client->input.len; i < client->input.len + n; i++)
+	{
+		if (client->input.data[i] != '\n')
+			continue;
+		if (!client->truncating)
+			handleLine(client, client->input.data + start, i + 1 - start);
+		client->truncating = 0;
+		start = i + 1;
+	}
+	client->input.len += n;
+	consumeBuffer(&client->input, start);
+	if (client->input.len >= MAX_MESSAGE_SIZE)
+	{
+		if (!client->truncating)
+			handleLine(client, client->input.data, MAX_MESSAGE_SIZE);
+		client->truncating = 1;
+		client->input.len = 0;
+	}
+}
+
+// closes the connection and keeps the frames not yet written to it in full; unless the client is done, it
+// reconnects after the backoff, which doubles with every failed attempt
+void dropConnection(struct clientData * client, const char * reason)
+{
+	size_t offset = 0;
+	if (client->client_fd != -1)
+		close(client->client_fd);
+	client->client_fd = -1;
+	client->in.len = 0;
+
+	// frames written in full count as delivered, although the server may not have read all of them; one cut off
+	// by the loss is sent again whole
+	while (offset + FRAME_HEADER_SIZE <= client->out_sent &&
+		   offset + FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)client->out.data + offset) <= client->out_sent)
+		offset += FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)client->out.data + offset);
+	consumeBuffer(&client->out, offset);
+	client->out_sent = 0;
+
+	// the username is queued again once the new connection is accepted
+	if (client->state == CONN_ACTIVE && client->out.len > 0 &&
+		client->out.data[0] == FRAME_USERNAME)
+		consumeBuffer(&client->out, FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)client->out.data));
+
+	// input that has ended and was sent in full needs no new connection
+	if (!client->input_open && client->out.len == 0)
+		exit(0);
+	fprintf(stderr, "%s", reason);
+	if (!client->reconnect)
+		exit(1);
+	fprintf(stderr, "[CLIENT] Reconnecting in %d ms...\n", client->backoff);
+	client->state = CONN_WAITING;
+	client->next_attempt = now() + (uint64_t)client->backoff * 1000000;
+	client->backoff = (client->backoff * 2 > BACKOFF_MAX) ? BACKOFF_MAX : client->backoff * 2;
+}
+
+// starts connecting to the server; the attempt completes in the event loop
+void startConnect(struct clientData * client)
+{
+	client->client_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (client->client_fd == -1)
+		error("[CLIENT] ERROR: Failed to open socket.\n");
+	client->state = CONN_CONNECTING;
+	client->write_closed = 0;
+	if (connect(client->client_fd, (struct sockaddr *)&client->server_addr, sizeof(client->server_addr)) == 0)
+		client->state = CONN_HANDSHAKE;
+	else if (errno != EINPROGRESS)
+		dropConnection(client, "[CLIENT] ERROR: Connect failed.\n");
+}
+
+// handles every full frame received from the server; returns -1 if the connection was dropped
+int handleFrames(struct clientData * client)
+{
+	size_t offset = 0;
+	while (client->in.len - offset >= FRAME_HEADER_SIZE)
+	{
+		unsigned char * header = (unsigned char *)client->in.data + offset;
+		uint32_t len = decodeFrameLength(header);
+		if (len > MAX_FRAME_PAYLOAD)
 		{
-            // print warning message
-			fprintf(stderr, "[SERVER] Server will shut down in 10 seconds...\n");
-			
-			// wait for moment before server shuts down
-			sleep(9);
-			
-			// exit while loop
+			dropConnection(client, "[CLIENT] ERROR: Invalid frame received.\n");
+			return -1;
+		}
+		if (client->in.len - offset < FRAME_HEADER_SIZE + len)
 			break;
+		char * payload = (char *)header + FRAME_HEADER_SIZE;
+		offset += FRAME_HEADER_SIZE + len;
+
+		// check message received from server, perform special action if it is a command
+		if (header[0] == FRAME_TEXT)
+			fwrite(payload, 1, len, stdout);
+		else if (header[0] == FRAME_ACCEPTED && client->state == CONN_HANDSHAKE)
+		{
+			fprintf(stderr, "[SERVER] Connection successful!\n");
+			client->backoff = BACKOFF_MIN;
+			client->state = CONN_ACCEPTED;
+			if (!client->has_username && !client->accepted_once && isatty(STDIN_FILENO))
+				fprintf(stderr, "Enter your username: ");
+			client->accepted_once = 1;
+			sendUsername(client);
 		}
-		else if (strncmp(buffer, "-CLIENT KILL-", sizeof(buffer)) == 0)
+		else if (header[0] == FRAME_REFUSED)
 		{
-			// exit while loop
-			break;
+			dropConnection(client, "[SERVER] Maximum number of clients connected. Connection refused.\n");
+			return -1;
+		}
+		else if (header[0] == FRAME_SERVER_KILL)
+		{
+			dropConnection(client, "[SERVER] Server is shutting down.\n");
+			return -1;
+		}
+		else if (header[0] == FRAME_CLIENT_KILL)
+		{
+			fflush(stdout);
+			exit(0);
 		}
-		else
-			fprintf(stderr, "%s", buffer);
 	}
-	
-	// close socket, exit program
-	close(client_info->client_fd);
-	exit(0);
+	consumeBuffer(&client->in, offset);
+	fflush(stdout);
+	return 0;
 }
 
-// prints an error message to the console, then closes the program
-void error(char * message)
+// reads what the socket has and handles the frames in it; returns -1 if the connection was dropped
+int readServer(struct clientData * client)
 {
-	fprintf(stderr, "%s", message);
-	exit(1);
+	for (;;)
+	{
+		reserveBuffer(&client->in, READ_SIZE);
+		ssize_t n = read(client->client_fd, client->in.data + client->in.len, READ_SIZE);
+		if (n == 0)
+		{
+			dropConnection(client, "[CLIENT] Connection closed by server.\n");
+			return -1;
+		}
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			dropConnection(client, "[CLIENT] Connection lost.\n");
+			return -1;
+		}
+		client->in.len += n;
+		if (handleFrames(client) == -1)
+			return -1;
+	}
+}
+
+// writes as much of the queued frames as the socket takes with one call; returns -1 if the connection was dropped
+int writeServer(struct clientData * client)
+{
+	ssize_t n = send(client->client_fd, client->out.data + client->out_sent, client->out.len - client->out_sent,
+					 MSG_NOSIGNAL);
+	if (n == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		dropConnection(client, "[CLIENT] Connection lost.\n");
+		return -1;
+	}
+	client->out_sent += n;
+
+	// sent frames are removed once the buffer is empty or mostly sent, so the rest is not moved after every write
+	if (client->out_sent == client->out.len)
+	{
+		client->out.len = 0;
+		client->out_sent = 0;
+	}
+	else if (client->out_sent > client->out.size / 2)
+	{
+		size_t offset = 0;
+		while (offset + FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)client->out.data + offset) <=
+			   client->out_sent)
+			offset += FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)client->out.data + offset);
+		consumeBuffer(&client->out, offset);
+		client->out_sent -= offset;
+	}
+	return 0;
 }
 
 // client main thread
 int main(int argc, char ** argv)
-{		  
-	// set signal handler
-	signal(SIGINT, sigHandler);
-	
-	int sock_fd, port_no;				/* socket/port variables */
-	struct sockaddr_in server_addr;		/* server address */
+{
+	struct clientData client;			/* client and connection state */
 	struct hostent * h;                 /* host entity */
-	char username[100];					/* client username */
-	char buffer[MAX_BUFFER_SIZE];		/* socket read/write buffer */
-	pthread_t tid;						/* pthread for reading */
-	struct clientData client;			/* clientData struct */
-	
+	struct sigaction action;			/* SIGINT handler */
+	struct pollfd fds[2];				/* stdin and socket */
+	int port_no;						/* port number */
+	int option;							/* current command line option */
+
+	// set signal handler; it interrupts poll without ending the program
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sigHandler;
+	sigaction(SIGINT, &action, NULL);
+
+	memset(&client, 0, sizeof(client));
+	client.client_fd = -1;
+	client.reconnect = 1;
+	client.input_open = 1;
+	client.backoff = BACKOFF_MIN;
+
+	// read options
+	while ((option = getopt(argc, argv, "u:n")) != -1)
+	{
+		switch (option)
+		{
+			case 'u':
+				strncpy(client.username, optarg, MAX_USERNAME);
+				client.has_username = 1;
+				break;
+			case 'n':
+				client.reconnect = 0;
+				break;
+			default:
+				error("[CLIENT] ERROR: Invalid option. Usage is 'client [-u name] [-n] <server name> <port no>'\n");
+		}
+	}
+
 	// check validity of arguments
-	if (argc != 3)
-		error("[CLIENT] ERROR: Incorrect number of arguments. Usage is 'client <server name> <port no>'\n");
-	else if ((h = gethostbyname(argv[1])) == NULL)
+	if (argc - optind != 2)
+		error("[CLIENT] ERROR: Incorrect number of arguments. Usage is 'client [-u name] [-n] <server name> "
+			  "<port no>'\n");
+	else if ((h = gethostbyname(argv[optind])) == NULL)
 	{
-		printf("[CLIENT] ERROR: %s - Unknown host.\n", argv[1]);
+		printf("[CLIENT] ERROR: %s - Unknown host.\n", argv[optind]);
 		exit(1);
 	}
-	else if ((port_no = atoi(argv[2])) <= 0)
+	else if ((port_no = atoi(argv[optind + 1])) <= 0)
 		error("[CLIENT] ERROR: Invalid port number specified. Please specify a nonzero port number.\n");
-	
+
 	// copy host data into server_addr.sin_addr
-	memcpy(&server_addr.sin_addr, h->h_addr_list[0], h->h_length);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(atoi(argv[2]));
-	
-	// create new socket
-	if((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
-		error("[CLIENT] ERROR: Failed to open socket.\n");
-	
-	// connect socket
-	if(connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) 
-		error("[CLIENT] ERROR: Connect failed.\n");
-    
-    // check to see if server accepted connection
-    bzero(buffer, MAX_BUFFER_SIZE);
-	read(sock_fd, buffer, sizeof(buffer));
-    if (strncmp(buffer, "-CLIENT REFUSED-", sizeof(buffer)) == 0)
-        error("[SERVER] Maximum number of clients connected. Connection refused.\n");
-    else if (strncmp(buffer, "-CLIENT ACCEPTED-", sizeof(buffer)) == 0)
-    {
-        printf("[SERVER] Connection successful!\n");
-	
-        // get client username
-        printf("Enter your username: ");
-        scanf("%[^\t\n]", username);
-        while (getchar() != (int)'\n');
-	
-        // copy username into buffer
-        bzero(buffer, MAX_BUFFER_SIZE);
-        memcpy(buffer, username, sizeof(username));
-	
-        // introduce client to server by sending username
-        write(sock_fd, buffer, sizeof(buffer));
-        bzero(buffer, MAX_BUFFER_SIZE);
-        read(sock_fd, buffer, sizeof(buffer));
-        printf("%s\n", buffer);
-        bzero(buffer, MAX_BUFFER_SIZE);
-	
-        // update clientData for new client
-        client.client_fd = sock_fd;
-        client.server_addr = server_addr;
-        client.username = username;
-	
-        // create reader thread
-        int t = pthread_create(&tid, NULL, &reader, &client);
-        if (t != 0)
+	memcpy(&client.server_addr.sin_addr, h->h_addr_list[0], h->h_length);
+	client.server_addr.sin_family = AF_INET;
+	client.server_addr.sin_port = htons(port_no);
+
+	startConnect(&client);
+	for (;;)
+	{
+		int timeout = -1;
+		int pending = client.out.len - client.out_sent;
+
+		// stdin is read while the queue has room; the socket is written while frames are queued and the
+		// server knows who is sending them
+		fds[0].fd = (client.input_open && pending < MAX_PENDING) ? STDIN_FILENO : -1;
+		fds[0].events = POLLIN;
+		fds[1].fd = client.client_fd;
+		fds[1].events = POLLIN;
+		if (client.state == CONN_CONNECTING || (client.state == CONN_ACTIVE && pending > 0))
+			fds[1].events |= POLLOUT;
+		if (client.state == CONN_WAITING)
 		{
-			close(sock_fd);
-            error("[CLIENT] ERROR: Reader thread create failed.");
+			uint64_t time = now();
+			timeout = (client.next_attempt > time) ? (int)((client.next_attempt - time) / 1000000) + 1 : 0;
 		}
-	
-        // read input from keyboard until user disconnects
-        while (scanf("%[^\t\n]", buffer) > 0)
-        {
-            // collect terminating characters from stdin
-            while (getchar() != (int)'\n');
-        
-            // write buffer to socket
-            write(sock_fd, &buffer, sizeof(buffer));
-        
-            // empty buffer
-            bzero(buffer, MAX_BUFFER_SIZE);
-        }
-    }
-	
-	// close socket, exit program
-	close(sock_fd);
-	exit(0);
-}
\ No newline at end of file
+		if (poll(fds, 2, timeout) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			error("[CLIENT] ERROR: Poll failed.\n");
+		}
+
+		if (client.state == CONN_WAITING)
+		{
+			if (now() >= client.next_attempt)
+				startConnect(&client);
+		}
+		else if (client.state == CONN_CONNECTING && fds[1].revents)
+		{
+			int result = 0;
+			socklen_t result_len = sizeof(result);
+			getsockopt(client.client_fd, SOL_SOCKET, SO_ERROR, &result, &result_len);
+			if (result != 0)
+				dropConnection(&client, "[CLIENT] ERROR: Connect failed.\n");
+			else
+				client.state = CONN_HANDSHAKE;
+		}
+		else if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+			readServer(&client);
+
+		if (fds[0].fd != -1 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			readInput(&client);
+
+		// everything read in this round goes out with one write
+		if (client.state == CONN_ACTIVE && client.out.len > client.out_sent)
+			writeServer(&client);
+
+		// once stdin has ended and all is sent, the server closes the connection after handling the last frame
+		if (!client.input_open && client.out.len == 0 && !client.write_closed)
+		{
+			if (client.state == CONN_ACTIVE)
+			{
+				shutdown(client.client_fd, SHUT_WR);
+				client.write_closed = 1;
+			}
+			else if (client.state == CONN_WAITING || client.state == CONN_CONNECTING || !client.has_username)
+				exit(0);
+		}
+	}
+}
@@ -0,0 +1,121 @@
+/************************************************************************/
+/*   Maximilian Schroeder												*/
+/*																		*/
+/*   FILE NAME: histogram.h  (included by server.c and loadgen.c)      */
+/*                                                                      */
+/*   Log-linear latency histogram in the style of HdrHistogram. Values */
+/*   below 64 get a bucket each; above that, every power of two is      */
+/*   split into 32 buckets, so any recorded value is reported within    */
+/*   about 3% of its true value while the histogram stays a fixed       */
+/*   array of counters.                                                 */
+/*                                                                      */
+/*   A histogram has a single writer. Counters are updated with relaxed */
+/*   atomic loads and stores, which cost the same as plain ones, so     */
+/*   other threads may read a histogram while it is being written.      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HISTOGRAM_SUB_BITS 5		/* define log2 of buckets per power of two */
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)	/* define buckets covering uint64 */
+
+// histogram of non-negative values, e.g. latencies in microseconds
+struct histogram
+{
+	atomic_ullong counts[HISTOGRAM_BUCKETS];	/* amount of values recorded per bucket */
+	atomic_ullong total;						/* amount of values recorded */
+	atomic_ullong max;							/* largest value recorded */
+};
+
+// adds n to a counter that only the calling thread writes
+static inline void counterAdd(atomic_ullong * counter, unsigned long long n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// subtracts n from a counter that only the calling thread writes
+static inline void counterSub(atomic_ullong * counter, unsigned long long n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - n, memory_order_relaxed);
+}
+
+// reads a counter written by any thread
+static inline unsigned long long counterGet(atomic_ullong * counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// returns the bucket of the specified value
+static inline int histogramBucket(uint64_t value)
+{
+	if (value < (2u << HISTOGRAM_SUB_BITS))
+		return (int)value;
+	int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)(value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+}
+
+// returns the value in the middle of the specified bucket
+static inline uint64_t histogramValue(int bucket)
+{
+	if (bucket < (2 << HISTOGRAM_SUB_BITS))
+		return bucket;
+	int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)((bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS)) << shift;
+	return low + (((uint64_t)1 << shift) >> 1);
+}
+
+// records one value; only the histogram's writer may call this
+static inline void histogramRecord(struct histogram * histogram, uint64_t value)
+{
+	counterAdd(&histogram->counts[histogramBucket(value)], 1);
+	counterAdd(&histogram->total, 1);
+	if (value > counterGet(&histogram->max))
+		atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+// adds every value recorded in source to target; only target's writer may call this
+static inline void histogramMerge(struct histogram * target, struct histogram * source)
+{
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		unsigned long long count = counterGet(&source->counts[i]);
+		if (count > 0)
+			counterAdd(&target->counts[i], count);
+	}
+	counterAdd(&target->total, counterGet(&source->total));
+	if (counterGet(&source->max) > counterGet(&target->max))
+		atomic_store_explicit(&target->max, counterGet(&source->max), memory_order_relaxed);
+}
+
+// returns the value below which the specified percentage of recorded values lie; 0 if nothing was recorded
+static inline uint64_t histogramPercentile(struct histogram * histogram, double percentile)
+{
+	unsigned long long total = counterGet(&histogram->total);
+	unsigned long long rank = (unsigned long long)(total * percentile / 100.0 + 0.5);
+	unsigned long long seen = 0;
+	int i;
+
+	if (total == 0)
+		return 0;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += counterGet(&histogram->counts[i]);
+		if (seen >= rank)
+		{
+			uint64_t value = histogramValue(i);
+			uint64_t max = counterGet(&histogram->max);
+			return (value < max) ? value : max;
+		}
+	}
+	return counterGet(&histogram->max);
+}
+
+#endif
@@ -0,0 +1,626 @@
+/************************************************************************/
+/*   Maximilian Schroeder												*/
+/*																		*/
+/*   PROGRAM NAME: loadgen.c  (works with server.c)                     */
+/*                                                                      */
+/*   Load generator for the chat server. Opens many connections, does   */
+/*   the accept / username handshake on each of them, then sends chat   */
+/*   messages at a fixed total rate. Every message carries the time it  */
+/*   was sent, so every copy the server fans out to the other           */
+/*   connections yields one end-to-end latency sample.                  */
+/*                                                                      */
+/*   Reports the connection setup rate and handshake latency, the       */
+/*   messages sent and deliveries received per second, lost deliveries  */
+/*   and the p50/p99/p999 delivery latency (see histogram.h).           */
+/*                                                                      */
+/*   All connections join #lobby, so every message is delivered to      */
+/*   every other connection: n connections sending r msgs/s make the    */
+/*   server deliver r * (n - 1) msgs/s.                                 */
+/*                                                                      */
+/*   COMPILE:         gcc -pthread -o loadgen loadgen.c					*/
+/*	 RUN:			  loadgen [options] <server name> <port no>			*/
+/*                                                                      */
+/*   OPTIONS:         -c <n>      connections (default 100)             */
+/*                    -s <n>      connections that send (default all)   */
+/*                    -r <n>      messages sent per second (default     */
+/*                                1000)                                 */
+/*                    -d <n>      seconds to send for (default 10)      */
+/*                    -m <n>      message size in bytes (default 64)    */
+/*                    -t <n>      threads (default 1)                   */
+/*                                                                      */
+/************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>		/* define socket */
+#include <sys/epoll.h>		/* define epoll */
+#include <sys/resource.h>	/* define setrlimit */
+#include <netinet/in.h>		/* define internet socket */
+#include <netinet/tcp.h>	/* define TCP_NODELAY */
+#include <netdb.h>			/* define internet socket */
+#include "protocol.h"		/* define wire protocol */
+#include "histogram.h"		/* define latency histogram */
+
+#define MAX_EVENTS 256			/* define max number of events handled per epoll_wait */
+#define READ_CHUNK_SIZE 4096	/* define min free space in read buffer before each read */
+#define MAX_PENDING_BYTES (1 << 20)	/* define max unsent bytes per connection before sends are skipped */
+#define SETUP_TIMEOUT 30		/* define seconds allowed for all connections to finish the handshake */
+#define DRAIN_TIME 2			/* define seconds to wait for deliveries after the last message was sent */
+#define MARKER "LG:"			/* define prefix of messages sent by the load generator */
+
+// connection states
+#define STATE_CONNECTING 0		/* TCP connect in progress */
+#define STATE_ACCEPTING 1		/* waiting for the server to accept the client */
+#define STATE_JOINING 2			/* username sent, waiting for the welcome message */
+#define STATE_READY 3			/* handshake done */
+#define STATE_CLOSED 4			/* refused, failed or closed by server */
+
+// connection to the server
+struct connection
+{
+	int fd;								/* socket FD */
+	int state;							/* handshake state */
+	int index;							/* global index of connection, used in its username */
+	int watch_out;						/* true while epoll watches the socket for EPOLLOUT */
+	uint64_t connect_start;				/* time connect was called (ns) */
+	char * read_buffer;					/* received bytes not yet handled as frames */
+	int read_len;						/* amount of bytes in read_buffer */
+	int read_cap;						/* allocated size of read_buffer */
+	char * write_buffer;				/* bytes the socket did not accept yet */
+	int write_len;						/* amount of bytes in write_buffer */
+	int write_cap;						/* allocated size of write_buffer */
+};
+
+// load generator thread, driving its share of the connections
+struct worker
+{
+	pthread_t thread;					/* thread running the worker */
+	int epoll_fd;						/* epoll FD */
+	struct connection * connections;	/* connections of this worker */
+	int connection_count;				/* amount of connections */
+	int sender_count;					/* amount of connections (the first ones) that send */
+	double rate;						/* messages sent per second by this worker */
+	int next_sender;					/* index of connection sending the next message */
+	int pending;						/* connections still in the handshake */
+	int ready;							/* connections that finished the handshake */
+	int refused;						/* connections refused by the server */
+	int failed;							/* connections that failed or were closed */
+	unsigned long long sent;			/* messages sent */
+	unsigned long long stalled;			/* messages skipped because the connection had too much unsent data */
+	unsigned long long received;		/* load generator messages received */
+	unsigned long long bytes_received;	/* bytes received */
+	struct histogram handshake;			/* connect to welcome latency (us) */
+	struct histogram latency;			/* send to delivery latency (us) */
+};
+
+// global variables
+struct sockaddr_in server_addr;				/* server address */
+int connection_count = 100;					/* connections opened */
+int sender_count = -1;						/* connections that send messages, -1 = all */
+int message_rate = 1000;					/* messages sent per second by all connections */
+int duration = 10;							/* seconds to send for */
+int message_size = 64;						/* payload bytes per message */
+int thread_count = 1;						/* worker threads */
+pthread_barrier_t phase_barrier;			/* lines workers and main thread up between phases */
+uint64_t send_start;						/* time sending started (ns) */
+uint64_t send_end;							/* time sending stops (ns) */
+
+// prints an error message to the console, then closes the program.
+void error(char * message)
+{
+	fprintf(stderr, "%s", message);
+	exit(1);
+}
+
+// returns the current time of the monotonic clock in nanoseconds
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// sets the O_NONBLOCK flag on the specified FD
+int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// makes epoll watch the connection for EPOLLOUT while it has unsent data or is connecting
+void watchOutput(struct worker * worker, struct connection * connection, int watch)
+{
+	struct epoll_event event;
+	if (connection->watch_out == watch)
+		return;
+	event.events = EPOLLIN | (watch ? EPOLLOUT : 0);
+	event.data.ptr = connection;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+	connection->watch_out = watch;
+}
+
+// closes the connection; it is counted as failed unless it was refused
+void closeConnection(struct worker * worker, struct connection * connection, int refused)
+{
+	if (connection->state == STATE_CLOSED)
+		return;
+	if (connection->state != STATE_READY)
+		worker->pending--;
+	else
+		worker->ready--;
+	if (refused)
+		worker->refused++;
+	else
+		worker->failed++;
+	connection->state = STATE_CLOSED;
+	close(connection->fd);
+}
+
+// writes as much unsent data as the socket accepts; returns -1 if the connection failed
+int flushConnection(struct worker * worker, struct connection * connection)
+{
+	int offset = 0;
+	while (offset < connection->write_len)
+	{
+		ssize_t n = write(connection->fd, connection->write_buffer + offset, connection->write_len - offset);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		offset += n;
+	}
+	memmove(connection->write_buffer, connection->write_buffer + offset, connection->write_len - offset);
+	connection->write_len -= offset;
+	watchOutput(worker, connection, connection->write_len > 0);
+	return 0;
+}
+
+// sends a frame of the specified type and payload; returns -1 if the connection failed
+int sendFrame(struct worker * worker, struct connection * connection, int type, const char * payload, int len)
+{
+	// grow write_buffer if the frame does not fit
+	if (connection->write_len + FRAME_HEADER_SIZE + len > connection->write_cap)
+	{
+		int new_cap = connection->write_cap ? connection->write_cap : READ_CHUNK_SIZE;
+		while (new_cap < connection->write_len + FRAME_HEADER_SIZE + len)
+			new_cap *= 2;
+		char * new_buffer = realloc(connection->write_buffer, new_cap);
+		if (new_buffer == NULL)
+			return -1;
+		connection->write_buffer = new_buffer;
+		connection->write_cap = new_cap;
+	}
+
+	encodeFrameHeader((unsigned char *)connection->write_buffer + connection->write_len, type, len);
+	memcpy(connection->write_buffer + connection->write_len + FRAME_HEADER_SIZE, payload, len);
+	connection->write_len += FRAME_HEADER_SIZE + len;
+	return flushConnection(worker, connection);
+}
+
+// handles a complete frame received on the connection
+void handleFrame(struct worker * worker, struct connection * connection, int type, char * payload)
+{
+	char username[32];
+
+	switch (type)
+	{
+		case FRAME_ACCEPTED:
+			// answer with the username
+			snprintf(username, sizeof(username), "lg%d", connection->index);
+			connection->state = STATE_JOINING;
+			if (sendFrame(worker, connection, FRAME_USERNAME, username, strlen(username)) == -1)
+				closeConnection(worker, connection, 0);
+			break;
+		case FRAME_TEXT:
+			// the first text is the welcome message, which completes the handshake
+			if (connection->state == STATE_JOINING)
+			{
+				connection->state = STATE_READY;
+				worker->pending--;
+				worker->ready++;
+				histogramRecord(&worker->handshake, (now() - connection->connect_start) / 1000);
+				break;
+			}
+
+			// the text after the sender's username holds the send time; older messages are replays of the history
+			char * marker = strstr(payload, "): " MARKER);
+			if (marker != NULL)
+			{
+				uint64_t sent = strtoull(marker + 3 + strlen(MARKER), NULL, 10);
+				if (send_start != 0 && sent >= send_start)
+				{
+					worker->received++;
+					histogramRecord(&worker->latency, (now() - sent) / 1000);
+				}
+			}
+			break;
+		case FRAME_REFUSED:
+			closeConnection(worker, connection, 1);
+			break;
+		case FRAME_CLIENT_KILL:
+		case FRAME_SERVER_KILL:
+			closeConnection(worker, connection, 0);
+			break;
+	}
+}
+
+// reads all available data from the connection and handles every complete frame; returns -1 on disconnect
+int readConnection(struct worker * worker, struct connection * connection)
+{
+	for (;;)
+	{
+		// make room for another read, keeping one spare byte for terminating payloads
+		if (connection->read_cap - connection->read_len - 1 < READ_CHUNK_SIZE)
+		{
+			int new_cap = connection->read_cap ? connection->read_cap * 2 : 2 * READ_CHUNK_SIZE;
+			char * new_buffer = realloc(connection->read_buffer, new_cap);
+			if (new_buffer == NULL)
+				return -1;
+			connection->read_buffer = new_buffer;
+			connection->read_cap = new_cap;
+		}
+
+		ssize_t n = read(connection->fd, connection->read_buffer + connection->read_len,
+						 connection->read_cap - connection->read_len - 1);
+		if (n == 0)
+			return -1;
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		connection->read_len += n;
+		worker->bytes_received += n;
+
+		// handle complete frames
+		int offset = 0;
+		while (connection->read_len - offset >= FRAME_HEADER_SIZE && connection->state != STATE_CLOSED)
+		{
+			unsigned char * header = (unsigned char *)connection->read_buffer + offset;
+			uint32_t len = decodeFrameLength(header);
+			if (len > MAX_FRAME_PAYLOAD)
+				return -1;
+			if ((uint32_t)(connection->read_len - offset - FRAME_HEADER_SIZE) < len)
+				break;
+
+			// terminate payload in place (the buffer always has a spare byte) so it can be used as a string
+			char * payload = (char *)header + FRAME_HEADER_SIZE;
+			char saved = payload[len];
+			payload[len] = '\0';
+			handleFrame(worker, connection, header[0], payload);
+			payload[len] = saved;
+			offset += FRAME_HEADER_SIZE + len;
+		}
+		if (connection->state == STATE_CLOSED)
+			return 0;
+		memmove(connection->read_buffer, connection->read_buffer + offset, connection->read_len - offset);
+		connection->read_len -= offset;
+	}
+}
+
+// starts a non-blocking connect for the connection; returns -1 if it failed right away
+int openConnection(struct worker * worker, struct connection * connection)
+{
+	struct epoll_event event;
+	int nodelay = 1;
+
+	connection->connect_start = now();
+	connection->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connection->fd == -1)
+		return -1;
+	setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (setNonBlocking(connection->fd) == -1 ||
+		(connect(connection->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 &&
+		 errno != EINPROGRESS))
+	{
+		close(connection->fd);
+		return -1;
+	}
+
+	// the socket becomes writable once connected
+	connection->state = STATE_CONNECTING;
+	connection->watch_out = 1;
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = connection;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) == -1)
+	{
+		close(connection->fd);
+		return -1;
+	}
+	return 0;
+}
+
+// waits up to timeout ms for events and handles them
+void pollConnections(struct worker * worker, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i;
+
+	int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+	for (i = 0; i < n; i++)
+	{
+		struct connection * connection = events[i].data.ptr;
+		if (connection->state == STATE_CLOSED)
+			continue;
+
+		// a finished connect reports its result through SO_ERROR
+		if (connection->state == STATE_CONNECTING)
+		{
+			int result = 0;
+			socklen_t result_len = sizeof(result);
+			getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &result, &result_len);
+			if (result != 0)
+			{
+				closeConnection(worker, connection, 0);
+				continue;
+			}
+			connection->state = STATE_ACCEPTING;
+			watchOutput(worker, connection, 0);
+		}
+
+		if ((events[i].events & EPOLLOUT) && flushConnection(worker, connection) == -1)
+			closeConnection(worker, connection, 0);
+		else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && readConnection(worker, connection) == -1)
+			closeConnection(worker, connection, 0);
+	}
+}
+
+// sends every message that is due by now, spreading them over the sending connections round-robin
+void sendDue(struct worker * worker, uint64_t time)
+{
+	char payload[MAX_MESSAGE_SIZE];
+	unsigned long long due = (unsigned long long)((time - send_start) / 1e9 * worker->rate);
+	int tries;
+
+	while (worker->sent + worker->stalled < due)
+	{
+		// pick the next ready sender
+		struct connection * connection = NULL;
+		for (tries = 0; tries < worker->sender_count && connection == NULL; tries++)
+		{
+			struct connection * candidate = &worker->connections[worker->next_sender];
+			worker->next_sender = (worker->next_sender + 1) % worker->sender_count;
+			if (candidate->state == STATE_READY)
+				connection = candidate;
+		}
+		if (connection == NULL)
+			return;
+
+		// a connection that can not keep up skips its messages instead of queueing them without bound
+		if (connection->write_len > MAX_PENDING_BYTES)
+		{
+			worker->stalled++;
+			continue;
+		}
+
+		// message is the marker, the send time, then padding up to the message size
+		int len = snprintf(payload, sizeof(payload), MARKER "%llu:", (unsigned long long)now());
+		if (len < message_size)
+		{
+			memset(payload + len, 'x', message_size - len);
+			len = message_size;
+		}
+		if (sendFrame(worker, connection, FRAME_TEXT, payload, len) == -1)
+			closeConnection(worker, connection, 0);
+		else
+			worker->sent++;
+	}
+}
+
+// load generator thread: connects, waits for the other workers, sends for the configured duration, then drains
+void * runWorker(void * arg)
+{
+	struct worker * worker = arg;
+	uint64_t deadline;
+	int i;
+
+	// phase 1: connect and handshake
+	for (i = 0; i < worker->connection_count; i++)
+	{
+		if (openConnection(worker, &worker->connections[i]) == -1)
+		{
+			worker->connections[i].state = STATE_CLOSED;
+			worker->failed++;
+		}
+		else
+			worker->pending++;
+	}
+	deadline = now() + SETUP_TIMEOUT * 1000000000ull;
+	while (worker->pending > 0 && now() < deadline)
+		pollConnections(worker, 100);
+	pthread_barrier_wait(&phase_barrier);
+
+	// phase 2: send at the configured rate once the main thread has set the start time
+	pthread_barrier_wait(&phase_barrier);
+	for (;;)
+	{
+		uint64_t time = now();
+		if (time >= send_end)
+			break;
+		sendDue(worker, time);
+		pollConnections(worker, 1);
+	}
+
+	// phase 3: collect the deliveries still in flight
+	deadline = now() + DRAIN_TIME * 1000000000ull;
+	while (now() < deadline)
+		pollConnections(worker, 10);
+
+	for (i = 0; i < worker->connection_count; i++)
+	{
+		if (worker->connections[i].state != STATE_CLOSED)
+			close(worker->connections[i].fd);
+		free(worker->connections[i].read_buffer);
+		free(worker->connections[i].write_buffer);
+	}
+	return NULL;
+}
+
+// load generator main thread
+int main(int argc, char ** argv)
+{
+	struct hostent * h;										/* server hostent */
+	struct worker * workers;								/* worker threads */
+	struct worker total;									/* sum of all workers */
+	struct rlimit limit;									/* FD limit */
+	int port_no;											/* port number */
+	int option;												/* current command line option */
+	int i, first;											/* loop iterator variables */
+
+	// a connection closed by the server must not kill the load generator
+	signal(SIGPIPE, SIG_IGN);
+
+	// read options
+	while ((option = getopt(argc, argv, "c:s:r:d:m:t:")) != -1)
+	{
+		switch (option)
+		{
+			case 'c':
+				if ((connection_count = atoi(optarg)) < 2)
+					error("[LOADGEN] ERROR: At least 2 connections are needed.\n");
+				break;
+			case 's':
+				if ((sender_count = atoi(optarg)) < 1)
+					error("[LOADGEN] ERROR: At least 1 connection must send.\n");
+				break;
+			case 'r':
+				if ((message_rate = atoi(optarg)) < 1)
+					error("[LOADGEN] ERROR: Message rate must be at least 1 message per second.\n");
+				break;
+			case 'd':
+				if ((duration = atoi(optarg)) < 1)
+					error("[LOADGEN] ERROR: Duration must be at least 1 second.\n");
+				break;
+			case 'm':
+				if ((message_size = atoi(optarg)) < 32 || message_size > MAX_MESSAGE_SIZE - 100)
+					error("[LOADGEN] ERROR: Message size must be between 32 and 65436 bytes.\n");
+				break;
+			case 't':
+				if ((thread_count = atoi(optarg)) < 1)
+					error("[LOADGEN] ERROR: At least 1 thread is needed.\n");
+				break;
+			default:
+				error("[LOADGEN] ERROR: Invalid option. Usage is 'loadgen [-c n] [-s n] [-r n] [-d n] [-m n] [-t n] "
+					  "<server name> <port no>'.\n");
+		}
+	}
+
+	// check for validity of arguments
+	if (argc - optind != 2)
+		error("[LOADGEN] ERROR: Incorrect number of arguments. Usage is 'loadgen [options] <server name> <port no>'.\n");
+	if ((h = gethostbyname(argv[optind])) == NULL)
+		error("[LOADGEN] ERROR: Unknown host.\n");
+	if ((port_no = atoi(argv[optind + 1])) <= 0)
+		error("[LOADGEN] ERROR: Invalid port number specified. Please specify a nonzero port number.\n");
+	if (sender_count == -1 || sender_count > connection_count)
+		sender_count = connection_count;
+	if (thread_count > sender_count)
+		thread_count = sender_count;
+
+	// set values for server_addr struct
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	memcpy(&server_addr.sin_addr, h->h_addr_list[0], h->h_length);
+	server_addr.sin_port = htons(port_no);
+
+	// every connection needs an FD
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)connection_count + 64)
+	{
+		limit.rlim_cur = (limit.rlim_max < (rlim_t)connection_count + 64) ? limit.rlim_max : (rlim_t)connection_count + 64;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// split connections, senders and rate evenly over the workers
+	workers = calloc(thread_count, sizeof(struct worker));
+	if (workers == NULL)
+		error("[LOADGEN] ERROR: Out of memory.\n");
+	for (i = 0, first = 0; i < thread_count; i++)
+	{
+		struct worker * worker = &workers[i];
+		int j;
+		worker->connection_count = connection_count / thread_count + (i < connection_count % thread_count);
+		worker->sender_count = sender_count / thread_count + (i < sender_count % thread_count);
+		worker->rate = (double)message_rate * worker->sender_count / sender_count;
+		worker->connections = calloc(worker->connection_count, sizeof(struct connection));
+		worker->epoll_fd = epoll_create1(0);
+		if (worker->connections == NULL || worker->epoll_fd == -1)
+			error("[LOADGEN] ERROR: Out of memory.\n");
+		for (j = 0; j < worker->connection_count; j++)
+			worker->connections[j].index = first + j;
+		first += worker->connection_count;
+	}
+
+	// phase 1: workers connect; wait until all of them are done
+	printf("Opening %d connections to %s:%d...\n", connection_count, argv[optind], port_no);
+	pthread_barrier_init(&phase_barrier, NULL, thread_count + 1);
+	uint64_t setup_start = now();
+	for (i = 0; i < thread_count; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0)
+			error("[LOADGEN] ERROR: Failed to create thread.\n");
+	}
+	pthread_barrier_wait(&phase_barrier);
+	uint64_t setup_time = now() - setup_start;
+
+	// phase 2: start sending
+	printf("Sending %d messages/s of %d bytes from %d connections for %d s...\n", message_rate, message_size,
+		   sender_count, duration);
+	send_start = now();
+	send_end = send_start + (uint64_t)duration * 1000000000ull;
+	pthread_barrier_wait(&phase_barrier);
+	for (i = 0; i < thread_count; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	// sum up the workers
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < thread_count; i++)
+	{
+		total.ready += workers[i].ready;
+		total.refused += workers[i].refused;
+		total.failed += workers[i].failed;
+		total.pending += workers[i].pending;
+		total.sent += workers[i].sent;
+		total.stalled += workers[i].stalled;
+		total.received += workers[i].received;
+		total.bytes_received += workers[i].bytes_received;
+		histogramMerge(&total.handshake, &workers[i].handshake);
+		histogramMerge(&total.latency, &workers[i].latency);
+	}
+
+	// every message is delivered to every other connection that is ready
+	int handshakes = (int)counterGet(&total.handshake.total);
+	unsigned long long expected = total.sent * (unsigned long long)(total.ready > 1 ? total.ready - 1 : 0);
+	printf("\n--- LOAD GENERATOR RESULTS ---\n\n");
+	printf("Connections: %d ready, %d refused, %d failed, %d timed out in %.2f s (%.0f connections/s)\n",
+		   handshakes, total.refused, total.failed, total.pending, setup_time / 1e9, handshakes / (setup_time / 1e9));
+	printf("Handshake:   p50 %llu us, p99 %llu us, max %llu us\n",
+		   (unsigned long long)histogramPercentile(&total.handshake, 50),
+		   (unsigned long long)histogramPercentile(&total.handshake, 99), counterGet(&total.handshake.max));
+	printf("Sent:        %llu messages (%.0f messages/s), %llu skipped on full connections\n", total.sent,
+		   (double)total.sent / duration, total.stalled);
+	printf("Received:    %llu of %llu deliveries (%.0f messages/s, %.1f MB/s), %.2f%% lost\n", total.received,
+		   expected, (double)total.received / duration, total.bytes_received / 1e6 / duration,
+		   expected ? 100.0 * (expected - (total.received < expected ? total.received : expected)) / expected : 0.0);
+	printf("Latency:     p50 %llu us, p99 %llu us, p999 %llu us, max %llu us\n",
+		   (unsigned long long)histogramPercentile(&total.latency, 50),
+		   (unsigned long long)histogramPercentile(&total.latency, 99),
+		   (unsigned long long)histogramPercentile(&total.latency, 99.9), counterGet(&total.latency.max));
+	return 0;
+}
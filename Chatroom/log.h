@@ -0,0 +1,223 @@
+/************************************************************************/
+/*   Maximilian Schroeder												*/
+/*																		*/
+/*   FILE NAME: log.h  (included by server.c)                           */
+/*                                                                      */
+/*   Asynchronous console log. Threads format a line into a slot of a   */
+/*   bounded lock-free ring and return at once; a logger thread drains  */
+/*   the ring and writes the lines in large batches, so a slow terminal */
+/*   or disk never stalls an event loop. When the ring is full, lines   */
+/*   are dropped and counted instead of waiting for the logger.         */
+/*                                                                      */
+/*   The ring follows Vyukov's bounded queue: every slot carries a      */
+/*   sequence number telling producers whether it is free and the       */
+/*   logger whether it is filled, so claiming a slot is a single CAS.   */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define LOG_RING_SIZE 4096			/* define number of lines the ring holds (power of two) */
+#define LOG_LINE_SIZE 512			/* define max length of a line; longer lines are cut */
+#define LOG_BATCH_SIZE 65536		/* define max bytes written by the logger at once */
+
+// log levels; a line is logged if its level is at most the configured one
+#define LOG_ERROR 0					/* failures */
+#define LOG_WARN 1					/* clients dropped for misbehaving, lost messages */
+#define LOG_INFO 2					/* connections, room changes, server state */
+#define LOG_CHAT 3					/* every chat message */
+
+// slot of the log ring holding one line
+struct logSlot
+{
+	atomic_ullong sequence;			/* index the slot is free for, or index + 1 once it holds that line */
+	int len;						/* length of text */
+	char text[LOG_LINE_SIZE];		/* formatted line */
+};
+
+// log ring and the state of its logger thread
+struct logRing
+{
+	struct logSlot slots[LOG_RING_SIZE];	/* ring of lines */
+	atomic_ullong tail;				/* index of the next line claimed by a producer */
+	unsigned long long head;		/* index of the next line written by the logger (logger only) */
+	atomic_ullong dropped;			/* lines dropped because the ring was full */
+	atomic_int sleeping;			/* true while the logger waits for event_fd */
+	atomic_int stopping;			/* set to make the logger write what is left and exit */
+	int level;						/* highest level logged */
+	int fd;							/* FD lines are written to */
+	int event_fd;					/* eventfd waking the logger */
+	pthread_t thread;				/* logger thread */
+};
+
+static struct logRing * logger;		/* the log, NULL until startLogger */
+
+// appends a line to the log without blocking; before the logger is started, it is written directly
+static inline void logMessage(int level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+static inline void logMessage(int level, const char * format, ...)
+{
+	va_list args;
+	if (logger == NULL)
+	{
+		va_start(args, format);
+		vfprintf(stderr, format, args);
+		va_end(args);
+		return;
+	}
+	if (level > logger->level)
+		return;
+
+	// claim the slot at the tail, unless the logger has not freed it yet
+	unsigned long long pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+	struct logSlot * slot;
+	for (;;)
+	{
+		slot = &logger->slots[pos & (LOG_RING_SIZE - 1)];
+		long long diff = (long long)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - pos);
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&logger->tail, &pos, pos + 1, memory_order_relaxed,
+													  memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+	}
+
+	// format into the slot; a cut line still ends with a newline
+	va_start(args, format);
+	int len = vsnprintf(slot->text, LOG_LINE_SIZE, format, args);
+	va_end(args);
+	if (len < 0)
+		len = 0;
+	if (len >= LOG_LINE_SIZE)
+	{
+		len = LOG_LINE_SIZE - 1;
+		slot->text[len - 1] = '\n';
+	}
+	slot->len = len;
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+	// wake the logger if it ran out of lines; it checks the ring again after announcing that it sleeps
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&logger->sleeping))
+	{
+		uint64_t one = 1;
+		write(logger->event_fd, &one, sizeof(one));
+	}
+}
+
+// returns the amount of lines dropped because the log ring was full
+static inline unsigned long long logDropped()
+{
+	return logger ? atomic_load_explicit(&logger->dropped, memory_order_relaxed) : 0;
+}
+
+// copies the filled lines at the head of the ring into batch, up to LOG_BATCH_SIZE bytes, and frees their slots;
+// returns the amount of bytes copied
+static inline int drainLog(char * batch)
+{
+	int len = 0;
+	for (;;)
+	{
+		struct logSlot * slot = &logger->slots[logger->head & (LOG_RING_SIZE - 1)];
+		if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger->head + 1 ||
+			len + slot->len > LOG_BATCH_SIZE)
+			return len;
+		memcpy(batch + len, slot->text, slot->len);
+		len += slot->len;
+		atomic_store_explicit(&slot->sequence, logger->head + LOG_RING_SIZE, memory_order_release);
+		logger->head++;
+	}
+}
+
+// logger thread: writes batches of lines until stopLogger is called and the ring is empty
+static void * runLogger(void * arg)
+{
+	static char batch[LOG_BATCH_SIZE];
+	for (;;)
+	{
+		int len = drainLog(batch);
+		int written = 0;
+
+		// nothing to write: announce the wait, then look once more so a line appended meanwhile is not missed
+		if (len == 0)
+		{
+			if (atomic_load(&logger->stopping))
+				return NULL;
+			atomic_store(&logger->sleeping, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			if ((len = drainLog(batch)) == 0 && !atomic_load(&logger->stopping))
+			{
+				uint64_t count;
+				read(logger->event_fd, &count, sizeof(count));
+			}
+			atomic_store(&logger->sleeping, 0);
+		}
+
+		while (written < len)
+		{
+			ssize_t n = write(logger->fd, batch + written, len - written);
+			if (n <= 0)
+				break;
+			written += n;
+		}
+	}
+}
+
+// starts the logger thread writing lines up to the specified level to fd; returns -1 on failure
+static inline int startLogger(int fd, int level)
+{
+	struct logRing * ring = calloc(1, sizeof(struct logRing));
+	int i;
+	if (ring == NULL)
+		return -1;
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		atomic_init(&ring->slots[i].sequence, i);
+	ring->fd = fd;
+	ring->level = level;
+	ring->event_fd = eventfd(0, 0);
+	if (ring->event_fd == -1)
+	{
+		free(ring);
+		return -1;
+	}
+	logger = ring;
+	if (pthread_create(&ring->thread, NULL, runLogger, NULL) != 0)
+	{
+		logger = NULL;
+		close(ring->event_fd);
+		free(ring);
+		return -1;
+	}
+	return 0;
+}
+
+// writes every line still in the ring and stops the logger thread; later lines are written directly
+static inline void stopLogger()
+{
+	uint64_t one = 1;
+	if (logger == NULL)
+		return;
+	atomic_store(&logger->stopping, 1);
+	write(logger->event_fd, &one, sizeof(one));
+	pthread_join(logger->thread, NULL);
+	logger = NULL;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/************************************************************************/
+/*   Maximilian Schroeder												*/
+/*																		*/
+/*   FILE NAME: protocol.h  (included by server.c and client.c)        */
+/*                                                                      */
+/*   Wire protocol shared by Server and Client. Every message is a      */
+/*   frame: a 1-byte message type, a 4-byte payload length in network  */
+/*   byte order, then the payload itself (not NUL-terminated).          */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_HEADER_SIZE 5			/* define size of type byte + length field */
+#define MAX_MESSAGE_SIZE 65536		/* define max payload size of a frame sent by a client */
+#define MAX_PREFIX_SIZE 512			/* define max bytes the server adds around a client's text (sender, newline) */
+#define MAX_FRAME_PAYLOAD (MAX_MESSAGE_SIZE + MAX_PREFIX_SIZE)	/* define max payload size of a frame sent by a server */
+
+// message types
+#define FRAME_TEXT 1				/* chat text (client -> server) or display text (server -> client) */
+#define FRAME_USERNAME 2			/* client's username, first frame sent by a client */
+#define FRAME_ACCEPTED 3			/* server accepted the connection */
+#define FRAME_REFUSED 4				/* server refused the connection */
+#define FRAME_CLIENT_KILL 5			/* server disconnects this client */
+#define FRAME_SERVER_KILL 6			/* server is shutting down */
+#define FRAME_PEER 7				/* peer server's ID and federation key, first frame of a link (server -> server) */
+#define FRAME_RELAY 8				/* room message forwarded between peer servers (server -> server) */
+
+// writes the frame header for a payload of the specified type and length
+static inline void encodeFrameHeader(unsigned char * header, int type, uint32_t len)
+{
+	uint32_t net_len = htonl(len);
+	header[0] = (unsigned char)type;
+	memcpy(&header[1], &net_len, sizeof(net_len));
+}
+
+// returns the payload length stored in the specified frame header
+static inline uint32_t decodeFrameLength(const unsigned char * header)
+{
+	uint32_t net_len;
+	memcpy(&net_len, &header[1], sizeof(net_len));
+	return ntohl(net_len);
+}
+
+#endif
\ No newline at end of file
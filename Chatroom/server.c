@@ -9,440 +9,3979 @@
 /*                                                                      */
 /*   Using socket() to create an endpoint for communication. It         */
 /*   returns socket descriptor. Stream socket (SOCK_STREAM) is used here*/
-/*   as opposed to a Datagram Socket (SOCK_DGRAM)                       */  
+/*   as opposed to a Datagram Socket (SOCK_DGRAM)                       */
 /*   Using bind() to bind/assign a name to an unnamed socket.           */
 /*   Using listen() to listen for connections on a socket.              */
 /*   Using accept() to accept a connection on a socket. It returns      */
 /*   the descriptor for the accepted socket.                            */
 /*                                                                      */
+/*   All sockets are non-blocking and served by one event loop per shard*/
+/*   (-t), on edge-triggered epoll or, with -u, io_uring. Named clients */
+/*   chat in rooms, and messages are length-prefixed frames (see        */
+/*   protocol.h). Options add per-client rate limits, a journal that    */
+/*   keeps the rooms' history across restarts, hot upgrades that keep   */
+/*   clients connected, and federation with peer servers sharing rooms. */
+/*                                                                      */
 /*   To run this program, first compile the server.c and run it			*/
 /*   on a server machine. Then run the client program on another        */
 /*   machine.                                                           */
 /*                                                                      */
 /*   COMPILE:         gcc -pthread -o server server.c					*/
-/*	 RUN:			  server <port number>								*/
+/*	 RUN:			  server [options] <port number>					*/
+/*                                                                      */
+/*   OPTIONS:         -q <n>      max messages queued per client        */
+/*                    -b <n>      max bytes queued per client           */
+/*                    -p <policy> full queue policy: 'drop' drops the   */
+/*                                oldest message, 'disconnect' drops    */
+/*                                the slow client                       */
+/*                    -t <n>      number of event loop threads          */
+/*                    -r <n>      messages replayed to joining clients  */
+/*                    -w <s>      seconds a new client has to send its  */
+/*                                username                              */
+/*                    -u          use io_uring instead of epoll         */
+/*                    -m <n>      max messages per second per client    */
+/*                                (0 = no limit)                        */
+/*                    -k <n>      max KB per second per client          */
+/*                                (0 = no limit)                        */
+/*                    -f <n>      messages dropped from a flooding      */
+/*                                client before it is disconnected      */
+/*                    -l <level>  console log level: 'error', 'warn',   */
+/*                                'info' or 'chat' (default, everything)*/
+/*                    -j <file>   journal to replay on startup and      */
+/*                                append messages to                    */
+/*                    -x <path>   Unix socket to take over a running    */
+/*                                server from, and to listen on for the */
+/*                                next upgrade                          */
+/*                    -F <key>    federation key peer servers must      */
+/*                                present                               */
+/*                    -P <host:port> peer server to link to (with       */
+/*                                -F; may be given several times)       */
 /*                                                                      */
 /************************************************************************/
 
 
+#define _GNU_SOURCE			/* define accept4 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>			/* define INT_MAX */
 #include <signal.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>		/* define socket */
+#include <sys/un.h>			/* define Unix socket */
+#include <sys/epoll.h>		/* define epoll */
+#include <sys/uio.h>		/* define writev */
+#include <sys/eventfd.h>	/* define eventfd */
+#include <sys/mman.h>		/* define mmap */
+#include <sys/stat.h>		/* define fstat */
+#include <sys/syscall.h>	/* define io_uring system call numbers */
+#include <sys/random.h>		/* define getrandom */
+#include <endian.h>			/* define 64-bit byte order conversion */
+#include <poll.h>			/* define poll events */
+#include <linux/io_uring.h>	/* define io_uring */
 #include <netinet/in.h>		/* define internet socket */
 #include <netdb.h>			/* define internet socket */
-#include <pthread.h>		/* define pthread */
+#include "protocol.h"		/* define wire protocol */
+#include "histogram.h"		/* define counters and latency histograms */
+#include "log.h"			/* define asynchronous console log */
 
 #define MAX_BUFFER_SIZE 512		/* define max buffer size */
-#define MAX_CLIENT 10			/* define max number of clients */
+#define READ_CHUNK_SIZE 4096	/* define min free space in read buffer before each read */
+#define POLICY_DROP_OLDEST 0	/* full queue policy: drop oldest queued message */
+#define POLICY_DISCONNECT 1		/* full queue policy: disconnect slow client */
+#define MAX_EVENTS 256			/* define max number of events handled per epoll_wait */
+#define ACCEPT_BATCH 64			/* define max number of connections accepted per listener event */
+#define MAX_IOVECS 64			/* define max number of queued messages written per writev */
+#define MAX_SHARDS 64			/* define max number of event loop threads */
+#define MAX_ROOM_NAME 31		/* define max length of a room name */
+#define ROOM_TABLE_SIZE 1024	/* define number of buckets in each shard's room index */
+#define MAX_ROOMS 1024			/* define max number of rooms each shard keeps, with or without members */
+#define DEFAULT_ROOM "lobby"	/* define room clients are in after connecting */
+#define HISTORY_SIZE 16384		/* define bytes of frames kept in each room's history */
+#define HISTORY_LENGTH 64		/* define max number of messages kept in each room's history */
+#define THROTTLE_BACKLOG (2 * (FRAME_HEADER_SIZE + MAX_MESSAGE_SIZE))	/* define max bytes of frames waiting for tokens */
+#define RING_ENTRIES 1024		/* define number of submission queue entries of each shard's io_uring */
+#define RING_CQ_ENTRIES 8192	/* define number of completion queue entries of each shard's io_uring */
+#define RECV_BUFFERS 512		/* define number of provided receive buffers per shard (power of two) */
+#define RECV_BUFFER_SIZE 4096	/* define size of each provided receive buffer */
+#define RECV_GROUP 0			/* define buffer group ID of the provided receive buffers */
+#define JOURNAL_MAGIC "CHATJNL1"	/* define first bytes of a journal file */
+#define JOURNAL_MAGIC_SIZE 8	/* define length of JOURNAL_MAGIC */
+#define HANDOFF_RECORD_SIZE 65536	/* define max bytes of data in one record of an upgrade */
+#define MAX_PEERS 16			/* define max number of peer servers given with -P */
+#define MAX_STREAMS 1024		/* define max number of relay streams (origin server and shard) remembered */
+#define MAX_RELAY_HOPS 16		/* define max number of links a relayed message crosses */
+#define RELAY_HEADER_SIZE 19	/* define size of origin ID, stream, sequence number, hops and room name length */
+#define MAX_RELAY_PAYLOAD (RELAY_HEADER_SIZE + MAX_ROOM_NAME + MAX_FRAME_PAYLOAD)	/* define max payload of a relay */
+#define RELAY_WINDOW 64			/* define number of sequence numbers per stream remembered to drop copies */
+#define PEER_QUEUE_FACTOR 16	/* define how many times more a peer link may queue than a client */
+#define PEER_BACKOFF_MAX 30000	/* define max ms between attempts to link to a peer server */
+
+// kinds of io_uring requests, stored in the top bits of their user_data next to the FD and client ID
+#define REQUEST_ACCEPT 1		/* multishot accept on the listening socket */
+#define REQUEST_EVENT 2			/* multishot poll on the eventfd */
+#define REQUEST_RECV 3			/* multishot receive of a client */
+#define REQUEST_SEND 4			/* write of a client's queued messages */
+#define REQUEST_POLL 5			/* poll for room in a client's socket buffer */
+#define REQUEST_CANCEL 6		/* cancellation of a closed client's requests */
+
+// records sent by a server handing its state over to a new server, in this order
+#define HANDOFF_LISTENER 1		/* a listening socket (FD attached) */
+#define HANDOFF_ROOM 2			/* a room name and the frames of its history */
+#define HANDOFF_CLIENT 3		/* a client (FD attached), followed by HANDOFF_DATA with its buffers */
+#define HANDOFF_DATA 4			/* part of the buffers of the client last sent */
+#define HANDOFF_END 5			/* next client ID; the new server answers with one byte once it took over */
+
+// client states
+#define CLIENT_HANDSHAKE 0		/* accepted, waiting for the username */
+#define CLIENT_ACTIVE 1			/* named and in a room */
+#define CLIENT_PEER 2			/* link to a peer server */
+
+// results of firstSeen
+#define RELAY_NEW 0				/* first copy of the message */
+#define RELAY_COPY 1			/* copy of a message seen before */
+#define RELAY_STALE 2			/* message older than the window of its stream */
+
+// immutable serialized frame, shared by the queues of all its recipients
+struct sharedMessage
+{
+	atomic_int refs;					/* amount of queues and shard inboxes holding this message */
+	int len;							/* length of frame */
+	uint64_t created;					/* time the message was created (ns) */
+	char data[];						/* frame (header + payload) */
+};
+
+// entry of the global membership registry
+struct member
+{
+	int client_id;						/* client number shown in username */
+	int shard;							/* index of shard serving the client */
+	int client_fd;						/* client FD on its shard, to deliver direct messages */
+	char username[100];					/* client username */
+	char room[MAX_ROOM_NAME + 1];		/* name of client's room */
+};
+
+// immutable copy of the membership registry; replaced as a whole on every change
+struct registrySnapshot
+{
+	int count;							/* amount of members */
+	int index_size;						/* length of index (power of two) */
+	int * index;						/* hash table of positions in members by name and by #id, -1 = empty */
+	struct member members[];			/* members in no particular order, followed by index */
+};
+
+// join or leave recorded by a shard and published with the shard's other changes
+struct registryChange
+{
+	int leave;							/* true if the member leaves, else it joins */
+	struct member member;				/* member that joins or leaves (only client_id is used to leave) */
+};
+
+// snapshot replaced by a shard, freed once no shard can still be reading it
+struct retiredSnapshot
+{
+	struct registrySnapshot * snapshot;	/* replaced snapshot */
+	unsigned long long epoch;			/* registry_epoch when it was replaced */
+};
+
+// message posted to another shard's inbox or the journal
+struct shardPost
+{
+	struct shardPost * next;			/* next post in inbox (newer posts first) */
+	struct sharedMessage * message;		/* message to fan out, holds one reference */
+	struct sharedMessage * relay;		/* frame for the shard's peer links, NULL if not relayed; holds a reference */
+	int source_id;						/* ID of the peer link the message came from, 0 if it is local */
+	char room[MAX_ROOM_NAME + 1];		/* name of room to fan the message out to */
+	int client_fd;						/* FD of the recipient of a direct message */
+	int client_id;						/* ID of the recipient of a direct message, 0 for a room message */
+};
+
+// recent frames of a room, stored back to back in a ring of bytes allocated with the room's first message
+struct history
+{
+	char data[HISTORY_SIZE];			/* ring of frames (a frame may wrap around the end) */
+	int start[HISTORY_LENGTH];			/* ring of offsets of the frames in data */
+	int length[HISTORY_LENGTH];			/* ring of lengths of the frames in data */
+	int head;							/* index of oldest frame in start and length */
+	int count;							/* amount of frames kept */
+	int bytes;							/* bytes of data used by the frames */
+};
+
+// room of a shard, holding the shard's clients that are in the room and its history; other shards keep their
+// own entry
+struct room
+{
+	char name[MAX_ROOM_NAME + 1];		/* room name */
+	struct history * history;			/* recent messages of the room, NULL until its first message */
+	struct clientData ** members;		/* dense array of the shard's clients in the room */
+	int member_count;					/* amount of clients in members */
+	int member_list_size;				/* allocated length of members */
+	struct room * next;					/* next room in the same bucket of the room index */
+};
+
+// counters and histograms of a shard; written only by the shard's thread, read by /stats on any shard
+struct shardStats
+{
+	atomic_ullong clients;				/* connected clients */
+	atomic_ullong connections;			/* clients accepted */
+	atomic_ullong messages_in;			/* frames received */
+	atomic_ullong bytes_in;				/* bytes received */
+	atomic_ullong messages_out;			/* frames completely sent */
+	atomic_ullong bytes_out;			/* bytes sent */
+	atomic_ullong queued_messages;		/* messages in all clients' queues */
+	atomic_ullong queued_bytes;			/* bytes in all clients' queues */
+	atomic_ullong dropped;				/* messages dropped from full queues */
+	atomic_ullong slow_disconnects;		/* clients disconnected because their queue was full */
+	atomic_ullong handshake_timeouts;	/* clients dropped because they did not send their username in time */
+	atomic_ullong throttled;			/* times a client ran out of tokens and its frames had to wait */
+	atomic_ullong flood_drops;			/* frames dropped because too many were waiting for tokens */
+	atomic_ullong flood_disconnects;	/* clients disconnected because they kept sending too fast */
+	atomic_ullong peers;				/* open links to peer servers */
+	atomic_ullong relayed;				/* messages received from peer servers and delivered */
+	atomic_ullong relay_drops;			/* relayed messages dropped as already seen or too far travelled */
+	atomic_ullong relay_stale;			/* relayed messages dropped as older than the window of their stream */
+	struct histogram handle_latency;	/* time to handle a received frame (ns) */
+	struct histogram fanout_latency;	/* time from creating a message to queueing it for the shard's room (ns) */
+};
+
+// io_uring instance of a shard: the submission and completion rings shared with the kernel, and the ring of
+// provided buffers that receives are read into. A multishot accept and multishot receives replace the accept and
+// read calls, and the writes of all clients with new messages are submitted with one system call.
+struct uring
+{
+	int fd;								/* io_uring FD */
+	unsigned * sq_head;					/* index of next SQE the kernel takes (written by the kernel) */
+	unsigned * sq_tail;					/* index after the last SQE queued */
+	unsigned sq_mask;					/* mask applied to SQ indexes */
+	unsigned sq_entries;				/* length of sqes */
+	struct io_uring_sqe * sqes;			/* submission queue entries */
+	unsigned * cq_head;					/* index of next CQE to handle */
+	unsigned * cq_tail;					/* index after the last CQE posted (written by the kernel) */
+	unsigned cq_mask;					/* mask applied to CQ indexes */
+	struct io_uring_cqe * cqes;			/* completion queue entries */
+	struct io_uring_buf_ring * buffers;	/* ring of provided receive buffers */
+	char * buffer_data;					/* memory of the provided receive buffers */
+	struct iovec * iov;					/* iovecs of the writes in flight, MAX_IOVECS per client */
+	int iov_size;						/* allocated length of iov */
+	int sends;							/* writes submitted but not yet completed */
+	int armed;							/* multishot requests and polls not yet completed for good */
+	int collecting;						/* true while waiting for writes; other completions are deferred */
+	struct io_uring_cqe * deferred;		/* completions received while collecting, in arrival order */
+	int deferred_count;					/* amount of completions in deferred */
+	int deferred_size;					/* allocated length of deferred */
+};
+
+// event loop thread, owning a listener and the clients accepted on it
+struct shard
+{
+	int index;							/* index of shard in shards */
+	uint64_t relay_seq;					/* sequence number of the last message the shard relayed to peer servers */
+	pthread_t thread;					/* thread running the event loop */
+	int sock_fd;						/* listening socket FD */
+	int epoll_fd;						/* epoll FD */
+	struct uring * ring;				/* io_uring used instead of epoll, NULL if not used */
+	int event_fd;						/* eventfd signaled when posts arrive in inbox */
+	int spare_fd;						/* reserved FD, freed to refuse clients when out of FDs */
+	struct shardPost * _Atomic inbox;	/* lock-free stack of posts from other shards */
+	struct room ** rooms;				/* room index: hash table of rooms with members or history */
+	int room_count;						/* amount of rooms in rooms */
+	int evict_bucket;					/* bucket of rooms where the search for a room to evict continues */
+	struct clientData ** client_table;	/* clients indexed by FD */
+	int client_table_size;				/* allocated length of client_table */
+	struct clientData ** client_list;	/* dense array of connected clients */
+	int client_count;					/* amount of connected clients */
+	int client_list_size;				/* allocated length of client_list */
+	struct clientData ** closing_list;	/* clients waiting to be closed */
+	int closing_count;					/* amount of clients in closing_list */
+	int closing_list_size;				/* allocated length of closing_list */
+	struct clientData ** flush_list;	/* clients with newly queued messages, flushed once per loop */
+	int flush_count;					/* amount of clients in flush_list */
+	int flush_list_size;				/* allocated length of flush_list */
+	struct clientData * handshake_head;	/* clients in the handshake, oldest (first to time out) first */
+	struct clientData * handshake_tail;	/* newest client in the handshake */
+	struct clientData ** throttled_list;	/* clients with frames waiting for tokens */
+	int throttled_count;				/* amount of clients in throttled_list */
+	int throttled_list_size;			/* allocated length of throttled_list */
+	struct clientData ** peer_list;		/* links to peer servers */
+	int peer_count;						/* amount of links in peer_list */
+	int peer_list_size;					/* allocated length of peer_list */
+	struct shardStats stats;			/* counters of this shard */
+	atomic_ullong reader_epoch;			/* registry_epoch seen when the loop last woke up, 0 while idle */
+	struct registryChange * changes;	/* registry changes not yet published */
+	int change_count;					/* amount of changes in changes */
+	int change_list_size;				/* allocated length of changes */
+	struct retiredSnapshot * retired;	/* snapshots waiting to be freed */
+	int retired_count;					/* amount of snapshots in retired */
+	int retired_list_size;				/* allocated length of retired */
+};
 
-// struct of client data passed to client threads
+// struct of client data kept for every connected client
 struct clientData
-{			
-	int client_index;					/* client index */
+{
+	struct shard * shard;				/* shard serving the client */
+	int client_id;						/* client number shown in username */
 	int client_fd;						/* client FD */
+	int state;							/* CLIENT_HANDSHAKE or CLIENT_ACTIVE */
+	uint64_t handshake_deadline;		/* time the client is dropped unless it sent its username (ns) */
+	struct clientData * handshake_prev;	/* previous client in the shard's handshake list */
+	struct clientData * handshake_next;	/* next client in the shard's handshake list */
+	int list_index;						/* index of client in client_list */
+	int closing;						/* true once client is disconnecting */
 	struct sockaddr_in server_addr;		/* server address */
 	struct sockaddr_in client_addr;		/* client address */
+	char username[100];					/* client username (empty until received) */
+	char * read_buffer;					/* received bytes not yet handled as frames */
+	int read_len;						/* amount of bytes in read_buffer */
+	int read_cap;						/* allocated size of read_buffer */
+	struct sharedMessage ** out_queue;	/* ring buffer of messages not yet accepted by the socket */
+	int out_head;						/* index of oldest message in out_queue */
+	int out_count;						/* amount of messages in out_queue */
+	int out_size;						/* allocated length of out_queue */
+	int out_offset;						/* bytes of oldest message already sent */
+	int out_bytes;						/* bytes queued in out_queue */
+	int dropped;						/* messages dropped because out_queue was full */
+	int flush_pending;					/* true while client is in flush_list */
+	int poll_armed;						/* true while io_uring polls for room in the client's socket buffer */
+	double message_tokens;				/* messages the client may send now; negative after a burst */
+	double byte_tokens;					/* bytes the client may send now; negative after a large frame */
+	uint64_t tokens_updated;			/* time the token buckets were last refilled (ns) */
+	uint64_t resume_time;				/* time the frames of a throttled client may be handled (ns) */
+	int throttle_index;					/* index of client in throttled_list, -1 if not throttled */
+	int flood_drops;					/* frames of the client dropped because it sent too fast */
+	int peer_index;						/* index of client in peer_list, -1 if it is no peer link */
+	int peer_server;					/* index in peer_servers of the server this link was opened to, -1 if none */
+	struct room * room;					/* client's room (NULL until username is received) */
+	int room_index;						/* index of client in room's members */
+};
+
+// journal file and the state of its writer thread. A record is the length of the room name (1 byte), the room
+// name and the message frame; a journal is JOURNAL_MAGIC followed by records.
+struct journal
+{
+	int fd;								/* journal FD, -1 if no journal is kept */
+	int event_fd;						/* eventfd signaled when posts arrive in inbox */
+	struct shardPost * _Atomic inbox;	/* lock-free stack of messages to append */
+	atomic_int stopping;				/* set to make the writer append what is left and exit */
+	pthread_t thread;					/* writer thread */
+	off_t size;							/* length of the journal up to the last commit (writer only) */
+	atomic_ullong records;				/* messages appended */
+	atomic_ullong commits;				/* writes and fdatasyncs of a batch of messages */
+	atomic_ullong failures;				/* commits that failed; their messages are lost */
+	struct histogram commit_latency;	/* time to write and sync a batch (ns) */
+};
+
+// server this server links to (-P); only shard 0 opens its link
+struct peerServer
+{
+	char name[64];						/* host:port as given */
+	struct sockaddr_in addr;			/* address of the peer's chat port */
+	int link_id;						/* client ID of the open link, 0 if there is none */
+	int backoff;						/* ms to wait before the next attempt, 0 once the link was accepted */
+	uint64_t next_attempt;				/* time of the next attempt to link (ns) */
+};
+
+// relayed messages seen from one stream, the messages one shard of an origin server relays, to drop copies
+// arriving over other links
+struct relayStream
+{
+	uint64_t origin;					/* ID of the origin server */
+	int stream;							/* index of the shard of the origin server that numbered the messages */
+	uint64_t newest;					/* highest sequence number seen */
+	uint64_t window;					/* bit i set if sequence number newest - i was seen */
+	uint64_t last_seen;					/* time a message of the stream last arrived (ns) */
+};
+
+// header of a record sent during an upgrade; a record is one packet of the upgrade socket
+struct handoffRecord
+{
+	int type;							/* HANDOFF_* */
+	int len;							/* bytes of data following the header */
+};
+
+// client as sent in a HANDOFF_CLIENT record
+struct handoffClient
+{
+	int client_id;						/* client number shown in username */
+	int state;							/* CLIENT_HANDSHAKE or CLIENT_ACTIVE */
+	struct sockaddr_in client_addr;		/* client address */
+	int read_len;						/* bytes received but not yet handled, sent first */
+	int out_len;						/* bytes queued but not yet sent, sent after them */
 	char username[100];					/* client username */
+	char room[MAX_ROOM_NAME + 1];		/* name of client's room */
 };
 
 // global variables
-int sock_fd;								/* socket FD */
-int fd_array[MAX_CLIENT];					/* array of FDs for connected clients */
-pthread_t tid[MAX_CLIENT];					/* array of threads (clients) */
-struct clientData client_array[MAX_CLIENT];	/* array of clientData structs */
-pthread_mutex_t m_lock;						/* mutex lock */
+struct shard shards[MAX_SHARDS];			/* event loops */
+int shard_count = 1;						/* amount of event loops */
+atomic_int next_client_id = 1;				/* number given to next client */
 struct sockaddr_in server_addr;				/* server address */
+int max_queue_messages = 256;				/* max messages queued per client */
+int max_queue_bytes = 1 << 20;				/* max bytes queued per client */
+int queue_policy = POLICY_DROP_OLDEST;		/* what to do when a client's queue is full */
+int replay_length = 10;						/* messages replayed to a client joining a room */
+int handshake_timeout = 10;					/* seconds a new client has to send its username */
+int use_uring = 0;							/* true if shards run on io_uring instead of epoll */
+int message_rate = 0;						/* messages per second a client may send, 0 = no limit */
+int byte_rate = 0;							/* bytes per second a client may send, 0 = no limit */
+int flood_limit = 100;						/* frames dropped from a client before it is disconnected */
+int log_level = LOG_CHAT;					/* highest level written to the console */
+char * journal_path = NULL;					/* journal file, NULL if no journal is kept */
+struct journal journal = { .fd = -1 };		/* journal of all room messages */
+atomic_int shutdown_requested;				/* set by sigHandler, handled by event loops */
+atomic_int upgrading;						/* set with shutdown_requested when a new server takes over */
+char * upgrade_path = NULL;					/* Unix socket for upgrades, NULL if upgrades are off */
+int upgrade_fd = -1;						/* connection to the new server taking over */
+char * federation_key = NULL;				/* key peer servers must present, NULL if federation is off */
+uint64_t server_id;							/* random ID of this server, the origin of the messages it relays */
+struct peerServer peer_servers[MAX_PEERS];	/* servers to link to */
+int peer_server_count = 0;					/* amount of servers in peer_servers */
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects streams */
+struct relayStream streams[MAX_STREAMS];	/* streams of relayed messages, any order */
+int stream_count = 0;						/* amount of streams in streams */
+struct registrySnapshot * _Atomic registry;	/* current membership of all shards */
+atomic_ullong registry_epoch = 1;			/* advanced every time a snapshot is replaced */
+uint64_t start_time;						/* time the server started (ns) */
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects the totals of the last /stats */
+unsigned long long last_stats[4];			/* messages and bytes in and out at the last /stats */
+uint64_t last_stats_time;					/* time of the last /stats (ns) */
 
-// signal handler to catch SIGINT
+// signal handler to catch SIGINT; the event loop performs the shutdown
 void sigHandler(int signal)
 {
-	// send message to all connected clients that server is about to shut down
-	printf("[SERVER] Server will shut down in 10 seconds...\n");
-	char buffer[MAX_BUFFER_SIZE];
-	buffer[0] = '\0';
-	pthread_mutex_lock(&m_lock);
-	strcat(buffer, "-SERVER KILL-");
-	unsigned int i;
-	for (i = 0; i < MAX_CLIENT; i++)
+	shutdown_requested = 1;
+}
+
+// prints an error message to the console, then closes the program.
+void error(char * message)
+{
+	fprintf(stderr, "%s", message);
+	exit(1);
+}
+
+// returns the current time of the monotonic clock in nanoseconds
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// sets the O_NONBLOCK flag on the specified FD
+int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// records a registry change of the shard, published at the end of the current event loop iteration
+void recordChange(struct shard * shard, int leave, struct clientData * client_info)
+{
+	// grow changes if it is full
+	if (shard->change_count == shard->change_list_size)
 	{
-		if (fd_array[i] != -1)			
-			write(fd_array[i], &buffer, sizeof(buffer));
+		int new_size = shard->change_list_size ? shard->change_list_size * 2 : 16;
+		struct registryChange * list = realloc(shard->changes, new_size * sizeof(struct registryChange));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		shard->changes = list;
+		shard->change_list_size = new_size;
 	}
-	pthread_mutex_unlock(&m_lock);
-	
-	// wait 10 seconds
-	sleep(10);
-	
-	// close sockets, exit program
-	close(sock_fd);
-	for (i = 0; i < MAX_CLIENT; i++)
+
+	struct registryChange * change = &shard->changes[shard->change_count++];
+	change->leave = leave;
+	change->member.client_id = client_info->client_id;
+	change->member.shard = shard->index;
+	change->member.client_fd = client_info->client_fd;
+	strcpy(change->member.username, client_info->username);
+	strcpy(change->member.room, client_info->room ? client_info->room->name : "");
+}
+
+// returns the FNV-1a hash of the specified string
+unsigned int hashString(const char * string)
+{
+	unsigned int hash = 2166136261u;
+	while (*string != '\0')
+		hash = (hash ^ (unsigned char)*string++) * 16777619u;
+	return hash;
+}
+
+// returns the name the member chose, without the "#id: " its username starts with
+const char * memberName(struct member * member)
+{
+	const char * name = strstr(member->username, ": ");
+	return name ? name + 2 : member->username;
+}
+
+// adds the member at the specified position of members to the snapshot's index under the specified key
+void indexMember(struct registrySnapshot * snapshot, const char * key, int position)
+{
+	unsigned int slot = hashString(key) & (snapshot->index_size - 1);
+	while (snapshot->index[slot] != -1)
+		slot = (slot + 1) & (snapshot->index_size - 1);
+	snapshot->index[slot] = position;
+}
+
+// looks up the members with the specified name or #id in the snapshot's index, storing the positions of up to
+// max of them in found; returns the amount stored
+int findMembers(struct registrySnapshot * snapshot, const char * key, int * found, int max)
+{
+	unsigned int slot = hashString(key) & (snapshot->index_size - 1);
+	char id[16];
+	int count = 0;
+	int i;
+
+	// a member is indexed twice, so it may turn up under both keys if they hash close to each other
+	for (; snapshot->index[slot] != -1 && count < max; slot = (slot + 1) & (snapshot->index_size - 1))
 	{
-		if (fd_array[i] != -1)
-			close(fd_array[i]);
+		struct member * member = &snapshot->members[snapshot->index[slot]];
+		snprintf(id, sizeof(id), "#%d", member->client_id);
+		if (strcmp(memberName(member), key) != 0 && strcmp(id, key) != 0)
+			continue;
+		for (i = 0; i < count && found[i] != snapshot->index[slot]; i++)
+			;
+		if (i == count)
+			found[count++] = snapshot->index[slot];
 	}
-	unlink(server_addr.sin_addr);
-	exit(0);
+	return count;
 }
 
-// adds the specified new_sock_fd to fd_array, then returns index of new connection; FAIL = -1
-int openConnection(int new_sock_fd)
+// returns a new snapshot containing the specified snapshot with the shard's recorded changes applied; FAIL = NULL
+struct registrySnapshot * applyChanges(struct registrySnapshot * current, struct shard * shard)
 {
-	unsigned int i;
-	for (i = 0; i < MAX_CLIENT; i++)
+	int count = current ? current->count : 0;
+	int capacity = count + shard->change_count;
+	int index_size = 16;
+	char id[16];
+	int i, j;
+
+	// every member takes two slots of the index, which is kept at most half full
+	while (index_size < 4 * capacity)
+		index_size *= 2;
+	struct registrySnapshot * snapshot = malloc(sizeof(struct registrySnapshot) + capacity * sizeof(struct member) +
+												index_size * sizeof(int));
+	if (snapshot == NULL)
+		return NULL;
+	if (count > 0)
+		memcpy(snapshot->members, current->members, count * sizeof(struct member));
+
+	for (i = 0; i < shard->change_count; i++)
 	{
-		if (fd_array[i] == -1)
+		struct registryChange * change = &shard->changes[i];
+		if (!change->leave)
+		{
+			snapshot->members[count++] = change->member;
+			continue;
+		}
+
+		// move last member into the leaving member's slot
+		for (j = 0; j < count; j++)
 		{
-			fd_array[i] = new_sock_fd;
-			return i;
-		}			
+			if (snapshot->members[j].client_id == change->member.client_id)
+			{
+				snapshot->members[j] = snapshot->members[--count];
+				break;
+			}
+		}
 	}
-	return -1;	/* fd_array is full, no more new connections allowed */
-}
+	snapshot->count = count;
 
-// removes the specified sock_fd from fd_array
-void closeConnection(int client_index)
-{
-	fd_array[client_index] = -1;
+	// the index is rebuilt with every snapshot, which copies all members anyway
+	snapshot->index_size = index_size;
+	snapshot->index = (int *)&snapshot->members[capacity];
+	memset(snapshot->index, -1, index_size * sizeof(int));
+	for (i = 0; i < count; i++)
+	{
+		snprintf(id, sizeof(id), "#%d", snapshot->members[i].client_id);
+		indexMember(snapshot, id, i);
+		if (strcmp(memberName(&snapshot->members[i]), id) != 0)
+			indexMember(snapshot, memberName(&snapshot->members[i]), i);
+	}
+	return snapshot;
 }
 
-// prints an error message to the console, then closes the program.
-void error(char * message)
+// frees the shard's retired snapshots that no shard can be reading anymore: a shard that is idle, or that woke
+// up after a snapshot was replaced, can not hold it
+void reclaimSnapshots(struct shard * shard)
 {
-	fprintf(stderr, "%s", message);
-	exit(1);
+	unsigned long long oldest = ~0ULL;
+	int i;
+
+	for (i = 0; i < shard_count; i++)
+	{
+		unsigned long long epoch = atomic_load(&shards[i].reader_epoch);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	for (i = shard->retired_count - 1; i >= 0; i--)
+	{
+		if (shard->retired[i].epoch < oldest)
+		{
+			free(shard->retired[i].snapshot);
+			shard->retired[i] = shard->retired[--shard->retired_count];
+		}
+	}
 }
 
-// function used by new thread whenever a client connects to server
-void * client(void * arg)
+// publishes the shard's recorded joins and leaves as a new registry snapshot. Readers never lock: they load the
+// current snapshot and use it until their event loop iteration ends. Writers copy the snapshot, apply their
+// changes and swap it in with compare-and-swap, retrying if another shard published first.
+void publishRegistry(struct shard * shard)
 {
-	// get clientData struct from arg
-	struct clientData * client_info = (struct clientData *)arg;
-	
-	// print message about new client
-	fprintf(stderr, "A new client has connected! (%s)\n", client_info->username);
-	
-	// initialize buffers
-	char read_buffer[MAX_BUFFER_SIZE];
-	
-	// listen for messages from client until client disconnects
-	while ((read(client_info->client_fd, read_buffer, sizeof(read_buffer))) > 0)
-	{		
-		// read data from buffer
-		pthread_mutex_lock(&m_lock);
-		
-		// initialize write buffer
-		char buffer[MAX_BUFFER_SIZE];
-		buffer[0] = '\0';
-		
-		// initialize kirby buffer
-		char kirby_buffer[8];
-		
-		// initialize flags
-		int write_to_all = 0;
-		int disconnect = 0;
-		int kirby = 0;
-				
-		// check if read buffer contains a command, else write contents to all connected clients
-		if (read_buffer[0] == '/')
-		{
-			// get command text
-			char command_text[MAX_BUFFER_SIZE];
-			memcpy(command_text, &read_buffer[1], (sizeof(read_buffer) - 1));
-			
-			// execute specified command, else print error message
-			if (strncmp(command_text, "exit", sizeof(command_text)) == 0)
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// print disconnect message
-				strcat(read_buffer, "[SERVER] Client (");
-				strcat(read_buffer, client_info->username);
-				strcat(read_buffer, ") has disconnected.");
-				
-				// set write_to_all & disconnect flag
-				write_to_all = 1;
-				disconnect = 1;
-			}
-			else if (strncmp(command_text, "part", sizeof(command_text)) == 0)
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// print disconnect message
-				strcat(read_buffer, "[SERVER] Client (");
-				strcat(read_buffer, client_info->username);
-				strcat(read_buffer, ") has disconnected.");
-				
-				// set write_to_all & disconnect flag
-				write_to_all = 1;
-				disconnect = 1;
-			}
-			else if (strncmp(command_text, "quit", sizeof(command_text)) == 0)
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// print disconnect message
-				strcat(read_buffer, "[SERVER] Client (");
-				strcat(read_buffer, client_info->username);
-				strcat(read_buffer, ") has disconnected.");
-				
-				// set write_to_all & disconnect flag
-				write_to_all = 1;
-				disconnect = 1;
-			}
-			else if (strncmp(command_text, "kirby", sizeof(command_text)) == 0)
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// randomly determine which ASCII kirby to send :)
-				int y = rand() % 5;
-				switch (y)
-				{
-					case 0:
-						strcpy(kirby_buffer, "<('.')>");
-						break;
-					case 1:
-						strcpy(kirby_buffer, "<(^.^)>");
-						break;
-					case 2:
-						strcpy(kirby_buffer, "<(^.^<)");
-						break;
-					case 3:
-						strcpy(kirby_buffer, "(>^.^)>");
-						break;
-					case 4:
-						strcpy(kirby_buffer, "<('O')>");
-						break;
-				}
-				strcat(read_buffer, kirby_buffer);
-				write_to_all = 1;
-				kirby = 1;
-			}
-			else if (strncmp(command_text, "man", sizeof(command_text)) == 0)
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// print list of valid commands
-				strcat(read_buffer, "\n--- CHAT CLIENT COMMANDS ---\n\n");
-				strcat(read_buffer, "/exit --> Disconnects from chat server and exits.\n");
-				strcat(read_buffer, "/part --> Disconnects from chat server and exits.\n");
-				strcat(read_buffer, "/quit --> Disconnects from chat server and exits.\n");
-				strcat(read_buffer, "/man --> Well, you made it here, didn't you?\n");
-				strcat(read_buffer, "/kirby --> Try it. You know you want to. :)\n\n");
-			}
-			else
-			{
-				// empty read_buffer
-				bzero(read_buffer, MAX_BUFFER_SIZE);
-				read_buffer[0] = '\0';
-				
-				// print error message
-				strcat(read_buffer, "[SERVER] Invalid command. Use '/man' for a list of valid commands.\n");
-			}
+	if (shard->change_count > 0)
+	{
+		struct registrySnapshot * current = atomic_load(&registry);
+		struct registrySnapshot * snapshot;
+		for (;;)
+		{
+			snapshot = applyChanges(current, shard);
+			if (snapshot == NULL)
+				error("[SERVER] ERROR: Out of memory.\n");
+			if (atomic_compare_exchange_strong(&registry, &current, snapshot))
+				break;
+			free(snapshot);
 		}
-		else
-			write_to_all = 1;
-		
-		// if write_to_all flag is true, write buffer to all connected clients; else write buffer to this client
-		if (write_to_all)
-		{		
-			// if not a disconnect message, prepend username so clients can identify sender
-			if (!disconnect)
+		shard->change_count = 0;
+
+		// retire the replaced snapshot; shards that woke up before this point may still be reading it
+		if (current != NULL)
+		{
+			if (shard->retired_count == shard->retired_list_size)
 			{
-				strcat(buffer, "(");
-				strcat(buffer, client_info->username);
-				strcat(buffer, "): ");						
+				int new_size = shard->retired_list_size ? shard->retired_list_size * 2 : 16;
+				struct retiredSnapshot * list = realloc(shard->retired, new_size * sizeof(struct retiredSnapshot));
+				if (list == NULL)
+					error("[SERVER] ERROR: Out of memory.\n");
+				shard->retired = list;
+				shard->retired_list_size = new_size;
 			}
-			
-			// append message to buffer and write buffer to client sockets
-			strcat(buffer, read_buffer);
-			strcat(buffer, "\n");
-			unsigned int i;
-			for (i = 0; i < MAX_CLIENT; i++)
-			{				
-				if ((fd_array[i] != -1) && (fd_array[i] != client_info->client_fd))
-					write(fd_array[i], &buffer, sizeof(buffer));
-			}
-			
-			// echo message on server console
-			fprintf(stderr, "%s", buffer);
+			shard->retired[shard->retired_count].snapshot = current;
+			shard->retired[shard->retired_count].epoch = atomic_fetch_add(&registry_epoch, 1);
+			shard->retired_count++;
 		}
-		if (!write_to_all || kirby)
+	}
+
+	if (shard->retired_count > 0)
+		reclaimSnapshots(shard);
+}
+
+// returns the user_data of an io_uring request of the specified kind for the specified FD and client ID
+uint64_t requestData(int kind, int fd, int client_id)
+{
+	return ((uint64_t)kind << 60) | ((uint64_t)(fd & 0x0fffffff) << 32) | (uint32_t)client_id;
+}
+
+// submits the queued SQEs and, if wait is set, waits up to timeout ms (-1 = forever) for a completion;
+// returns -1 on failure (errno ETIME if the timeout expired)
+int enterRing(struct uring * ring, int wait, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (wait && timeout >= 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000ll;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0,
+				   IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+}
+
+// returns a cleared SQE queued for the next submission, submitting the queue first if it is full; the kernel
+// only reads SQEs during io_uring_enter, so the entry is published before the caller fills it
+struct io_uring_sqe * getSqe(struct uring * ring)
+{
+	unsigned tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries && enterRing(ring, 0, -1) == -1)
+		error("[SERVER] ERROR: io_uring_enter failed.\n");
+	struct io_uring_sqe * sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// hands the specified provided buffer back to the kernel for further receives
+void recycleBuffer(struct uring * ring, int id)
+{
+	unsigned short tail = ring->buffers->tail;
+	struct io_uring_buf * buffer = &ring->buffers->bufs[tail & (RECV_BUFFERS - 1)];
+	buffer->addr = (uint64_t)(uintptr_t)(ring->buffer_data + (size_t)id * RECV_BUFFER_SIZE);
+	buffer->len = RECV_BUFFER_SIZE;
+	buffer->bid = id;
+	__atomic_store_n(&ring->buffers->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// queues a multishot accept on the shard's listening socket; new sockets are created non-blocking. Addresses are
+// not collected, since all accepts share one request.
+void armAccept(struct shard * shard)
+{
+	struct io_uring_sqe * sqe = getSqe(shard->ring);
+	shard->ring->armed++;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->sock_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = requestData(REQUEST_ACCEPT, shard->sock_fd, 0);
+}
+
+// queues a multishot poll on the shard's eventfd, completing whenever posts arrive in the inbox
+void armEvents(struct shard * shard)
+{
+	struct io_uring_sqe * sqe = getSqe(shard->ring);
+	shard->ring->armed++;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->event_fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = requestData(REQUEST_EVENT, shard->event_fd, 0);
+}
+
+// queues a multishot receive of the client, which completes with a provided buffer whenever data arrives
+void armRecv(struct clientData * client_info)
+{
+	struct io_uring_sqe * sqe = getSqe(client_info->shard->ring);
+	client_info->shard->ring->armed++;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client_info->client_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_GROUP;
+	sqe->user_data = requestData(REQUEST_RECV, client_info->client_fd, client_info->client_id);
+}
+
+// queues a poll that completes once the client's socket buffer has room again
+void armPoll(struct clientData * client_info)
+{
+	struct io_uring_sqe * sqe = getSqe(client_info->shard->ring);
+	client_info->shard->ring->armed++;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = client_info->client_fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = requestData(REQUEST_POLL, client_info->client_fd, client_info->client_id);
+	client_info->poll_armed = 1;
+}
+
+// queues the cancellation of the client's pending request with the specified user_data
+void cancelRequest(struct clientData * client_info, uint64_t user_data)
+{
+	struct io_uring_sqe * sqe = getSqe(client_info->shard->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = requestData(REQUEST_CANCEL, client_info->client_fd, client_info->client_id);
+}
+
+// creates the shard's io_uring, maps its rings, registers the provided receive buffers and arms the accept and
+// eventfd requests; must run on the shard's thread, the only one submitting to the ring. Returns -1 if io_uring
+// or one of the features used is not available.
+int openRing(struct shard * shard)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	struct uring * ring = calloc(1, sizeof(struct uring));
+	unsigned i;
+
+	if (ring == NULL)
+		return -1;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = RING_CQ_ENTRIES;
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0)
+	{
+		free(ring);
+		return -1;
+	}
+
+	// both rings share one mapping; SQEs have their own
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	char * rings = MAP_FAILED;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) && (params.features & IORING_FEAT_EXT_ARG))
+		rings = mmap(NULL, (sq_size > cq_size) ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (rings != MAP_FAILED)
+		ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->buffers = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffer_data = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buffers;
+	reg.ring_entries = RECV_BUFFERS;
+	reg.bgid = RECV_GROUP;
+	if (rings == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED || ring->buffer_data == NULL ||
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		close(ring->fd);		/* the shard exits with the server, so the mappings are left to it */
+		free(ring->buffer_data);
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	// SQE i always sits in slot i of the SQ ring
+	for (i = 0; i < params.sq_entries; i++)
+		((unsigned *)(rings + params.sq_off.array))[i] = i;
+	for (i = 0; i < RECV_BUFFERS; i++)
+		recycleBuffer(ring, i);
+
+	shard->ring = ring;
+	armAccept(shard);
+	armEvents(shard);
+	return 0;
+}
+
+// returns the bucket of the room index for the specified room name
+unsigned int hashRoom(const char * name)
+{
+	return hashString(name) % ROOM_TABLE_SIZE;
+}
+
+// returns the shard's room with the specified name; NULL if the room has neither members nor history
+struct room * findRoom(struct shard * shard, const char * name)
+{
+	struct room * room;
+	for (room = shard->rooms[hashRoom(name)]; room != NULL; room = room->next)
+	{
+		if (strcmp(room->name, name) == 0)
+			return room;
+	}
+	return NULL;
+}
+
+// returns true if the specified string can be used as a room name
+int validRoomName(const char * name)
+{
+	int len = 0;
+	if (name == NULL)
+		return 0;
+	for (; name[len] != '\0'; len++)
+	{
+		char c = name[len];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+			return 0;
+	}
+	return len > 0 && len <= MAX_ROOM_NAME;
+}
+
+// unlinks the room from the shard's room index and frees it with its history
+void removeRoom(struct shard * shard, struct room * room)
+{
+	struct room ** link = &shard->rooms[hashRoom(room->name)];
+	while (*link != room)
+		link = &(*link)->next;
+	*link = room->next;
+	shard->room_count--;
+	free(room->history);
+	free(room->members);
+	free(room);
+}
+
+// frees a room of the shard that has no members, along with its history; the search goes on through the buckets
+// where the last one stopped, so the rooms take turns. Returns -1 if every room has members.
+int evictRoom(struct shard * shard)
+{
+	struct room * room;
+	int i;
+
+	for (i = 0; i < ROOM_TABLE_SIZE; i++)
+	{
+		int bucket = (shard->evict_bucket + i) % ROOM_TABLE_SIZE;
+		for (room = shard->rooms[bucket]; room != NULL; room = room->next)
 		{
-			if (kirby)
-			{
-				// display the ASCII kirby generated by the client's command
-				bzero(buffer, MAX_BUFFER_SIZE);
-				buffer[0] == '\0';
-				strcat(buffer, "You sent a Kirby! --> ");
-				strcat(buffer, kirby_buffer);
-				strcat(buffer, "\n");
-			}			
-			else
+			if (room->member_count == 0)
 			{
-				// append message to buffer and write buffer to socket
-				strcat(buffer, read_buffer);
-				strcat(buffer, "\n");
+				shard->evict_bucket = (bucket + 1) % ROOM_TABLE_SIZE;
+				removeRoom(shard, room);
+				return 0;
 			}
-			write(client_info->client_fd, &buffer, sizeof(buffer));
-		}		
-		pthread_mutex_unlock(&m_lock);
-		
-		// if disconnect flag is true, disconnect this client from server.
-		if (disconnect)
-		{
-			// empty read_buffer
-			bzero(buffer, MAX_BUFFER_SIZE);
-			buffer[0] = '\0';
-			strcat(buffer, "-CLIENT KILL-");
-			pthread_mutex_lock(&m_lock);
-			write(client_info->client_fd, &buffer, sizeof(buffer));
-			pthread_mutex_unlock(&m_lock);
-			
-			// exit while loop
-			break;
 		}
 	}
-	
-	// remove client's FD from fd_array
-	pthread_mutex_lock(&m_lock);
-	closeConnection(client_info->client_index);
-	pthread_mutex_unlock(&m_lock);
-	
-	// exit thread
-	return NULL;
+	return -1;
 }
 
-// server main thread
-int main(int argc, char ** argv)
+// returns the shard's room with the specified name, creating it without history if needed. Past MAX_ROOMS a room
+// without members is evicted to make space; FAIL = NULL if every room has members, except for the default room,
+// which can always be opened.
+struct room * openRoom(struct shard * shard, const char * name)
 {
-	// set signal handler
-	signal(SIGINT, sigHandler);
-	
-	// seed random
-	srand(time(NULL));
-	
-	int new_sock_fd, port_no, client_addr_len, n;			/* socket/connection variables */
-	struct sockaddr_in client_addr;							/* client address */
-	char buffer[MAX_BUFFER_SIZE];							/* socket read/write buffer */
-	char hostname[100];									/* server hostname */
-	struct hostent * h;										/* serve hostent */
-	unsigned int i;											/* loop iterator variable */
-	
-	// check for validity of arguments
-	if (argc != 2)
-		error("[SERVER] ERROR: Incorrect number of arguments. Usage is 'server <port number>'.\n");
-	else if ((port_no = atoi(argv[1])) <= 0)
-		error("[SERVER] ERROR: Invalid port number specified. Please specify a nonzero port number.\n");
-	
-	// initialize fd_array	
-	for (i = 0; i < MAX_CLIENT; i++)
-		fd_array[i] = -1;
-	
-	// create new socket
-	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock_fd < 0)
-		error("[SERVER] ERROR: Failed to open socket.\n");
-	
-	// set values for server_addr struct
-	server_addr.sin_family = AF_INET;						/* Internet addresses */
-	server_addr.sin_port = htons(port_no);					/* port number */
-	server_addr.sin_addr.s_addr = INADDR_ANY;				/* IP address of machine running server */
-	
-	// bind socket to server address
-	if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-		error("[SERVER] ERROR: Failed to bind socket.\n");
-	
-	// server started successfully, print server IP address
-	gethostname(hostname, sizeof(hostname));
-	h = gethostbyname(hostname);
-	printf("Server started successfully. [%s]\n", h->h_name);
-	
-	// listen for clients
-	printf("Server is listening for clients...\n");
-	if (listen(sock_fd, 1) == -1)
-		error("[SERVER] ERROR: Listen failed.\n");
-	
-	// accept client connections
-	while ((new_sock_fd = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len)) > 0)
-	{
-		pthread_mutex_lock(&m_lock);
-		
-		// update fd_array		
-		int client_index = openConnection(new_sock_fd);
-		
-		// check if there is room for new client and add client if true
-		if (client_index == -1)
-		{
-			// send refusal message to client, close socket
-			fprintf(stderr, "[SERVER] Maximum number of clients connected. New client refused.\n");
-			bzero(buffer, MAX_BUFFER_SIZE);
-			buffer[0] = '\0';
-			strcat(buffer, "-CLIENT REFUSED-");
-			write(new_sock_fd, buffer, sizeof(buffer));
-			close(new_sock_fd);
-		}
-		else
-		{			
-			// send acceptance message to client
-			bzero(buffer, MAX_BUFFER_SIZE);
-			buffer[0] = '\0';
-			strcat(buffer, "-CLIENT ACCEPTED-");
-			write(new_sock_fd, buffer, sizeof(buffer));
-			bzero(buffer, MAX_BUFFER_SIZE);
-			
-			// update clientData for new client
-			client_array[client_index].client_index = client_index;
-			client_array[client_index].client_fd = new_sock_fd;
-			client_array[client_index].client_addr = client_addr;
-			client_array[client_index].server_addr = server_addr;
-			
-			// get client's username
-			read(new_sock_fd, buffer, sizeof(buffer));
-			bzero(client_array[client_index].username, 100);
-			client_array[client_index].username[0] = '\0';
-			sprintf(client_array[client_index].username, "#%i: %s", (client_index + 1),buffer);
-			
-			// send client a reply, acknowledging connect
-			bzero(buffer, MAX_BUFFER_SIZE);
-			buffer[0] = '\0';
-			strcat(buffer, "Welcome to the chat server, (");
-			strcat(buffer, client_array[client_index].username);
-			strcat(buffer, ")!\nType a message and press ENTER to send.\n");
-			write(new_sock_fd, buffer, sizeof(buffer));
-			bzero(buffer, MAX_BUFFER_SIZE);
-			
-			// create new thread for client
-			int t = pthread_create(&tid[client_index], NULL, &client, &client_array[client_index]);
-			if (t != 0)
-				error("[SERVER] ERROR: Client thread create failed.\n");
-		}
-		pthread_mutex_unlock(&m_lock);
-	}
-	if (new_sock_fd == -1)
-		error("[SERVER] ERROR: Accept failed.\n");
-	
-	// close sock_fd, client's sock_fd's exit program
-	close(sock_fd);
-	for (i = 0; i < MAX_CLIENT; i++)
-	{
-		if (client_array[i].client_fd != -1)
-			close(client_array[i].client_fd);
-	}
-	unlink(server_addr.sin_addr);
-	exit(0);
+	struct room * room = findRoom(shard, name);
+	if (room == NULL)
+	{
+		unsigned int bucket = hashRoom(name);
+		if (shard->room_count >= MAX_ROOMS && evictRoom(shard) == -1 && strcmp(name, DEFAULT_ROOM) != 0)
+			return NULL;
+		room = calloc(1, sizeof(struct room));
+		if (room == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		strcpy(room->name, name);
+		room->next = shard->rooms[bucket];
+		shard->rooms[bucket] = room;
+		shard->room_count++;
+	}
+	return room;
+}
+
+// adds the client to the shard's room with the specified name, creating the room if needed; a client whose room
+// can not be opened goes to the default room
+void enterRoom(struct clientData * client_info, const char * name)
+{
+	struct room * room = openRoom(client_info->shard, name);
+	if (room == NULL)
+		room = openRoom(client_info->shard, DEFAULT_ROOM);
+
+	// grow members if it is full
+	if (room->member_count == room->member_list_size)
+	{
+		int new_size = room->member_list_size ? room->member_list_size * 2 : 8;
+		struct clientData ** list = realloc(room->members, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		room->members = list;
+		room->member_list_size = new_size;
+	}
+	client_info->room = room;
+	client_info->room_index = room->member_count;
+	room->members[room->member_count++] = client_info;
+}
+
+// removes the client from its room, freeing the room once it has neither members nor history
+void exitRoom(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	struct room * room = client_info->room;
+	if (room == NULL)
+		return;
+
+	// move last member into the removed client's slot of members
+	struct clientData * last = room->members[--room->member_count];
+	room->members[client_info->room_index] = last;
+	last->room_index = client_info->room_index;
+	client_info->room = NULL;
+
+	if (room->member_count == 0 && room->history == NULL)
+		removeRoom(shard, room);
+}
+
+// adds a client for the specified new_sock_fd to the shard's client_table and client_list, then returns it;
+// FAIL = NULL
+struct clientData * openConnection(struct shard * shard, int new_sock_fd)
+{
+	struct clientData * client_info;
+
+	// grow client_table until it can be indexed by new_sock_fd
+	if (new_sock_fd >= shard->client_table_size)
+	{
+		int new_size = shard->client_table_size ? shard->client_table_size : 64;
+		while (new_size <= new_sock_fd)
+			new_size *= 2;
+		struct clientData ** table = realloc(shard->client_table, new_size * sizeof(struct clientData *));
+		if (table == NULL)
+			return NULL;
+		memset(&table[shard->client_table_size], 0,
+			   (new_size - shard->client_table_size) * sizeof(struct clientData *));
+		shard->client_table = table;
+		shard->client_table_size = new_size;
+	}
+
+	// grow client_list if it is full
+	if (shard->client_count == shard->client_list_size)
+	{
+		int new_size = shard->client_list_size ? shard->client_list_size * 2 : 64;
+		struct clientData ** list = realloc(shard->client_list, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			return NULL;
+		shard->client_list = list;
+		shard->client_list_size = new_size;
+	}
+
+	client_info = calloc(1, sizeof(struct clientData));
+	if (client_info == NULL)
+		return NULL;
+	client_info->shard = shard;
+	client_info->client_fd = new_sock_fd;
+	client_info->list_index = shard->client_count;
+	client_info->throttle_index = -1;
+	client_info->peer_index = -1;
+	client_info->peer_server = -1;
+	client_info->message_tokens = message_rate;
+	client_info->byte_tokens = byte_rate;
+	client_info->tokens_updated = now();
+	shard->client_table[new_sock_fd] = client_info;
+	shard->client_list[shard->client_count++] = client_info;
+	counterAdd(&shard->stats.clients, 1);
+	counterAdd(&shard->stats.connections, 1);
+	return client_info;
+}
+
+// creates a shared message containing a frame of the specified type and payload, which may be NULL to fill it in
+// later; the caller holds the first reference and must release it; FAIL = NULL
+struct sharedMessage * createMessage(int type, const char * payload, int len)
+{
+	struct sharedMessage * message = malloc(sizeof(struct sharedMessage) + FRAME_HEADER_SIZE + len);
+	if (message == NULL)
+		return NULL;
+	atomic_init(&message->refs, 1);
+	message->len = FRAME_HEADER_SIZE + len;
+	message->created = now();
+	encodeFrameHeader((unsigned char *)message->data, type, len);
+	if (len > 0 && payload != NULL)
+		memcpy(message->data + FRAME_HEADER_SIZE, payload, len);
+	return message;
+}
+
+// adds a reference to the shared message
+void retainMessage(struct sharedMessage * message)
+{
+	atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+}
+
+// drops one reference to the shared message, freeing it when nothing holds it anymore
+void releaseMessage(struct sharedMessage * message)
+{
+	if (atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) == 1)
+		free(message);
+}
+
+// removes the oldest message from the client's queue
+void popMessage(struct clientData * client_info)
+{
+	struct sharedMessage * message = client_info->out_queue[client_info->out_head];
+	client_info->out_bytes -= message->len;
+	counterSub(&client_info->shard->stats.queued_messages, 1);
+	counterSub(&client_info->shard->stats.queued_bytes, message->len);
+	releaseMessage(message);
+	client_info->out_head = (client_info->out_head + 1) % client_info->out_size;
+	client_info->out_count--;
+	client_info->out_offset = 0;
+}
+
+// drops every message queued for the client
+void clearQueue(struct clientData * client_info)
+{
+	while (client_info->out_count > 0)
+		popMessage(client_info);
+}
+
+// drops the oldest queued message that has not been partially sent; returns -1 if there is none
+int dropOldest(struct clientData * client_info)
+{
+	// a partially sent message must be completed to keep the stream in sync, so drop the one after it
+	if (client_info->out_offset == 0 && client_info->out_count > 0)
+		popMessage(client_info);
+	else if (client_info->out_count > 1)
+	{
+		int head = client_info->out_head;
+		int next = (head + 1) % client_info->out_size;
+		client_info->out_bytes -= client_info->out_queue[next]->len;
+		counterSub(&client_info->shard->stats.queued_messages, 1);
+		counterSub(&client_info->shard->stats.queued_bytes, client_info->out_queue[next]->len);
+		releaseMessage(client_info->out_queue[next]);
+		client_info->out_queue[next] = client_info->out_queue[head];
+		client_info->out_head = next;
+		client_info->out_count--;
+	}
+	else
+		return -1;
+
+	client_info->dropped++;
+	counterAdd(&client_info->shard->stats.dropped, 1);
+	return 0;
+}
+
+// adds a newly accepted client to the end of its shard's handshake list; since every client gets the same
+// timeout, the list stays ordered by deadline
+void startHandshake(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	client_info->state = CLIENT_HANDSHAKE;
+	client_info->handshake_deadline = now() + (uint64_t)handshake_timeout * 1000000000ull;
+	client_info->handshake_prev = shard->handshake_tail;
+	client_info->handshake_next = NULL;
+	if (shard->handshake_tail != NULL)
+		shard->handshake_tail->handshake_next = client_info;
+	else
+		shard->handshake_head = client_info;
+	shard->handshake_tail = client_info;
+}
+
+// removes the client from its shard's handshake list
+void endHandshake(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->handshake_prev != NULL)
+		client_info->handshake_prev->handshake_next = client_info->handshake_next;
+	else
+		shard->handshake_head = client_info->handshake_next;
+	if (client_info->handshake_next != NULL)
+		client_info->handshake_next->handshake_prev = client_info->handshake_prev;
+	else
+		shard->handshake_tail = client_info->handshake_prev;
+	client_info->handshake_prev = client_info->handshake_next = NULL;
+}
+
+// adds the client to its shard's throttled_list; its waiting frames are handled at its resume_time
+void addThrottled(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->throttle_index != -1)
+		return;
+	if (shard->throttled_count == shard->throttled_list_size)
+	{
+		int new_size = shard->throttled_list_size ? shard->throttled_list_size * 2 : 64;
+		struct clientData ** list = realloc(shard->throttled_list, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		shard->throttled_list = list;
+		shard->throttled_list_size = new_size;
+	}
+	client_info->throttle_index = shard->throttled_count;
+	shard->throttled_list[shard->throttled_count++] = client_info;
+}
+
+// removes the client from its shard's throttled_list, moving the last throttled client into its slot
+void removeThrottled(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->throttle_index == -1)
+		return;
+	struct clientData * last = shard->throttled_list[--shard->throttled_count];
+	shard->throttled_list[client_info->throttle_index] = last;
+	last->throttle_index = client_info->throttle_index;
+	client_info->throttle_index = -1;
+}
+
+// adds the client to its shard's peer links
+void addPeer(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (shard->peer_count == shard->peer_list_size)
+	{
+		int new_size = shard->peer_list_size ? shard->peer_list_size * 2 : 8;
+		struct clientData ** list = realloc(shard->peer_list, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		shard->peer_list = list;
+		shard->peer_list_size = new_size;
+	}
+	client_info->state = CLIENT_PEER;
+	client_info->peer_index = shard->peer_count;
+	shard->peer_list[shard->peer_count++] = client_info;
+	counterAdd(&shard->stats.peers, 1);
+}
+
+// removes the client from its shard's peer links, if it is one; a link to a server given with -P is opened again
+void removePeer(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->peer_index == -1)
+		return;
+	struct clientData * last = shard->peer_list[--shard->peer_count];
+	shard->peer_list[client_info->peer_index] = last;
+	last->peer_index = client_info->peer_index;
+	client_info->peer_index = -1;
+	counterSub(&shard->stats.peers, 1);
+
+	// failed attempts to link are retried quietly
+	if (client_info->peer_server == -1)
+		logMessage(LOG_INFO, "[SERVER] A peer server has unlinked.\n");
+	else
+	{
+		struct peerServer * peer = &peer_servers[client_info->peer_server];
+		if (peer->backoff == 0)
+			logMessage(LOG_INFO, "[SERVER] Link to peer server %s closed.\n", peer->name);
+		peer->link_id = 0;
+	}
+}
+
+// removes the specified client from its shard's client_table and client_list, closes its socket and frees it
+void closeConnection(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+
+	// named clients leave their room and the registry, others the handshake list
+	if (client_info->state == CLIENT_ACTIVE)
+	{
+		recordChange(shard, 1, client_info);
+		exitRoom(client_info);
+	}
+	else if (client_info->handshake_prev != NULL || shard->handshake_head == client_info)
+		endHandshake(client_info);
+	removeThrottled(client_info);
+	removePeer(client_info);
+
+	// move last client into the removed client's slot of client_list
+	struct clientData * last = shard->client_list[--shard->client_count];
+	counterSub(&shard->stats.clients, 1);
+	shard->client_list[client_info->list_index] = last;
+	last->list_index = client_info->list_index;
+
+	// io_uring requests hold the socket open until they are cancelled
+	if (shard->ring != NULL && !shutdown_requested)
+	{
+		cancelRequest(client_info, requestData(REQUEST_RECV, client_info->client_fd, client_info->client_id));
+		if (client_info->poll_armed)
+			cancelRequest(client_info, requestData(REQUEST_POLL, client_info->client_fd, client_info->client_id));
+	}
+
+	shard->client_table[client_info->client_fd] = NULL;
+	close(client_info->client_fd);		/* also removes FD from epoll set */
+	clearQueue(client_info);
+	free(client_info->read_buffer);
+	free(client_info->out_queue);
+	free(client_info);
+}
+
+// marks the specified client as disconnecting; the event loop closes it once its pending data is sent
+void markClosing(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->closing)
+		return;
+
+	// grow closing_list if it is full
+	if (shard->closing_count == shard->closing_list_size)
+	{
+		int new_size = shard->closing_list_size ? shard->closing_list_size * 2 : 64;
+		struct clientData ** list = realloc(shard->closing_list, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		shard->closing_list = list;
+		shard->closing_list_size = new_size;
+	}
+	client_info->closing = 1;
+	shard->closing_list[shard->closing_count++] = client_info;
+}
+
+// drops the shard's clients whose handshake deadline has passed; returns the ms until the next deadline, or -1
+// if no client is in the handshake
+int expireHandshakes(struct shard * shard)
+{
+	uint64_t time = now();
+	while (shard->handshake_head != NULL && shard->handshake_head->handshake_deadline <= time)
+	{
+		struct clientData * client_info = shard->handshake_head;
+		endHandshake(client_info);
+		counterAdd(&shard->stats.handshake_timeouts, 1);
+		clearQueue(client_info);
+		markClosing(client_info);
+	}
+	if (shard->handshake_head == NULL)
+		return -1;
+	return (int)((shard->handshake_head->handshake_deadline - time + 999999) / 1000000);
+}
+
+// fills iov with up to MAX_IOVECS of the client's queued messages, skipping the part of the oldest one already sent;
+// returns the amount of iovecs filled
+int gatherQueue(struct clientData * client_info, struct iovec * iov)
+{
+	int iov_count = (client_info->out_count < MAX_IOVECS) ? client_info->out_count : MAX_IOVECS;
+	int i;
+	for (i = 0; i < iov_count; i++)
+	{
+		struct sharedMessage * message = client_info->out_queue[(client_info->out_head + i) % client_info->out_size];
+		iov[i].iov_base = message->data;
+		iov[i].iov_len = message->len;
+	}
+	iov[0].iov_base = (char *)iov[0].iov_base + client_info->out_offset;
+	iov[0].iov_len -= client_info->out_offset;
+	return iov_count;
+}
+
+// releases the queued messages completed by writing n bytes, remembering how much of the next one was sent
+void consumeQueue(struct clientData * client_info, ssize_t n)
+{
+	counterAdd(&client_info->shard->stats.bytes_out, n);
+	while (n > 0)
+	{
+		int remaining = client_info->out_queue[client_info->out_head]->len - client_info->out_offset;
+		if (n < remaining)
+		{
+			client_info->out_offset += n;
+			break;
+		}
+		n -= remaining;
+		popMessage(client_info);
+		counterAdd(&client_info->shard->stats.messages_out, 1);
+	}
+}
+
+// writes as many queued messages to the client as the socket accepts, batching them with writev;
+// returns -1 if the connection failed
+int flushClient(struct clientData * client_info)
+{
+	struct iovec iov[MAX_IOVECS];
+
+	while (client_info->out_count > 0)
+	{
+		int iov_count = gatherQueue(client_info, iov);
+		ssize_t n = writev(client_info->client_fd, iov, iov_count);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		consumeQueue(client_info, n);
+
+		// a short write means the socket buffer is full
+		if (client_info->out_count > 0 && client_info->out_offset > 0)
+			break;
+	}
+	return 0;
+}
+
+// adds a message to the client's queue, applying the backpressure policy if the queue is full;
+// returns -1 if the message was not queued
+int queueMessage(struct clientData * client_info, struct sharedMessage * message)
+{
+	// make room in a full queue: drop old messages, or give up on the slow client. A peer link carries the
+	// messages of a whole server and may queue more.
+	int factor = (client_info->state == CLIENT_PEER) ? PEER_QUEUE_FACTOR : 1;
+	while (client_info->out_count > 0 && (client_info->out_count >= max_queue_messages * factor ||
+										  client_info->out_bytes + message->len > (long long)max_queue_bytes * factor))
+	{
+		if (queue_policy == POLICY_DISCONNECT || dropOldest(client_info) == -1)
+		{
+			if (queue_policy == POLICY_DISCONNECT)
+			{
+				logMessage(LOG_WARN, "[SERVER] Client (%s) is too slow, disconnecting.\n", client_info->username);
+				counterAdd(&client_info->shard->stats.slow_disconnects, 1);
+			}
+			clearQueue(client_info);
+			markClosing(client_info);
+			return -1;
+		}
+	}
+
+	// grow ring buffer, unwrapping it into the new array
+	if (client_info->out_count == client_info->out_size)
+	{
+		int new_size = client_info->out_size ? client_info->out_size * 2 : 8;
+		struct sharedMessage ** queue = malloc(new_size * sizeof(struct sharedMessage *));
+		int i;
+		if (queue == NULL)
+			return -1;
+		for (i = 0; i < client_info->out_count; i++)
+			queue[i] = client_info->out_queue[(client_info->out_head + i) % client_info->out_size];
+		free(client_info->out_queue);
+		client_info->out_queue = queue;
+		client_info->out_head = 0;
+		client_info->out_size = new_size;
+	}
+
+	client_info->out_queue[(client_info->out_head + client_info->out_count) % client_info->out_size] = message;
+	client_info->out_count++;
+	client_info->out_bytes += message->len;
+	counterAdd(&client_info->shard->stats.queued_messages, 1);
+	counterAdd(&client_info->shard->stats.queued_bytes, message->len);
+	retainMessage(message);
+	return 0;
+}
+
+// adds the client to its shard's flush_list once, so its queued messages are written at the end of the current
+// event loop iteration
+void scheduleFlush(struct clientData * client_info)
+{
+	struct shard * shard = client_info->shard;
+	if (client_info->flush_pending)
+		return;
+	if (shard->flush_count == shard->flush_list_size)
+	{
+		int new_size = shard->flush_list_size ? shard->flush_list_size * 2 : 64;
+		struct clientData ** list = realloc(shard->flush_list, new_size * sizeof(struct clientData *));
+		if (list == NULL)
+			error("[SERVER] ERROR: Out of memory.\n");
+		shard->flush_list = list;
+		shard->flush_list_size = new_size;
+	}
+	client_info->flush_pending = 1;
+	shard->flush_list[shard->flush_count++] = client_info;
+}
+
+// queues a shared message for the client; it is written with the client's other new messages at the end of
+// the current event loop iteration
+void sendMessage(struct clientData * client_info, struct sharedMessage * message)
+{
+	if (client_info->closing || queueMessage(client_info, message) == -1)
+		return;
+	scheduleFlush(client_info);
+}
+
+// queues a frame of the specified type and payload for the client
+void sendFrame(struct clientData * client_info, int type, const char * payload, int len)
+{
+	struct sharedMessage * message = createMessage(type, payload, len);
+	if (message == NULL)
+		return;
+	sendMessage(client_info, message);
+	releaseMessage(message);
+}
+
+// queues a text frame containing the specified string for the client
+void sendText(struct clientData * client_info, const char * text)
+{
+	sendFrame(client_info, FRAME_TEXT, text, strlen(text));
+}
+
+// sends the client the newest count messages of its room's history. The frames are contiguous in the ring, so
+// they are written straight from it with one writev; only what the socket does not accept is copied into a
+// single queued message.
+void replayHistory(struct clientData * client_info, int count)
+{
+	struct history * history = client_info->room->history;
+	struct iovec iov[2];
+	int iov_count = 1;
+	ssize_t written = 0;
+	int i;
+
+	if (history == NULL)
+		return;
+	if (count > history->count)
+		count = history->count;
+	if (count <= 0)
+		return;
+
+	// locate the newest count frames in data
+	int first = (history->head + history->count - count) % HISTORY_LENGTH;
+	int start = history->start[first];
+	int len = 0;
+	for (i = 0; i < count; i++)
+		len += history->length[(first + i) % HISTORY_LENGTH];
+	iov[0].iov_base = history->data + start;
+	iov[0].iov_len = len;
+	if (start + len > HISTORY_SIZE)
+	{
+		iov[0].iov_len = HISTORY_SIZE - start;
+		iov[1].iov_base = history->data;
+		iov[1].iov_len = len - iov[0].iov_len;
+		iov_count = 2;
+	}
+
+	// frames already queued must be sent first to keep the stream in order
+	if (flushClient(client_info) == -1)
+	{
+		markClosing(client_info);
+		return;
+	}
+	if (client_info->out_count == 0)
+	{
+		written = writev(client_info->client_fd, iov, iov_count);
+		if (written == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				markClosing(client_info);
+				return;
+			}
+			written = 0;
+		}
+		counterAdd(&client_info->shard->stats.bytes_out, written);
+	}
+	if (written == len)
+		return;
+
+	// queue the rest as one message; the frame boundaries inside it do not matter to the queue
+	struct sharedMessage * message = malloc(sizeof(struct sharedMessage) + len - written);
+	if (message == NULL)
+		return;
+	atomic_init(&message->refs, 1);
+	message->len = 0;
+	message->created = now();
+	for (i = 0; i < iov_count; i++)
+	{
+		if (written >= (ssize_t)iov[i].iov_len)
+		{
+			written -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(message->data + message->len, (char *)iov[i].iov_base + written, iov[i].iov_len - written);
+		message->len += iov[i].iov_len - written;
+		written = 0;
+	}
+	sendMessage(client_info, message);
+	releaseMessage(message);
+}
+
+// appends the frame to the room's history, evicting the oldest frames until it fits; frames larger than the
+// history are not kept
+void recordHistory(struct room * room, const char * frame, int len)
+{
+	struct history * history = room->history;
+	int end, first;
+	if (len > HISTORY_SIZE)
+		return;
+
+	// the ring is filled as frames arrive, so only the counters need to start out cleared
+	if (history == NULL)
+	{
+		history = malloc(sizeof(struct history));
+		if (history == NULL)
+			return;
+		history->head = 0;
+		history->count = 0;
+		history->bytes = 0;
+		room->history = history;
+	}
+	while (history->count > 0 && (history->count == HISTORY_LENGTH || history->bytes + len > HISTORY_SIZE))
+	{
+		history->bytes -= history->length[history->head];
+		history->head = (history->head + 1) % HISTORY_LENGTH;
+		history->count--;
+	}
+
+	// place frame right after the newest one, wrapping around the end of data
+	if (history->count == 0)
+		end = 0;
+	else
+	{
+		int newest = (history->head + history->count - 1) % HISTORY_LENGTH;
+		end = (history->start[newest] + history->length[newest]) % HISTORY_SIZE;
+	}
+	first = (len < HISTORY_SIZE - end) ? len : HISTORY_SIZE - end;
+	memcpy(history->data + end, frame, first);
+	memcpy(history->data, frame + first, len - first);
+
+	int slot = (history->head + history->count) % HISTORY_LENGTH;
+	history->start[slot] = end;
+	history->length[slot] = len;
+	history->count++;
+	history->bytes += len;
+}
+
+// queues the message for the shard's clients in the specified room, except the sender, and adds it to the
+// shard's history of the room. A shard whose rooms all have members keeps no history of a room it has no
+// members in.
+void fanOut(struct shard * shard, struct clientData * sender, const char * name, struct sharedMessage * message)
+{
+	struct room * room = openRoom(shard, name);
+	int i;
+	if (room == NULL)
+	{
+		histogramRecord(&shard->stats.fanout_latency, now() - message->created);
+		return;
+	}
+	recordHistory(room, message->data, message->len);
+	for (i = 0; i < room->member_count; i++)
+	{
+		if (room->members[i] != sender)
+			sendMessage(room->members[i], message);
+	}
+	histogramRecord(&shard->stats.fanout_latency, now() - message->created);
+}
+
+// creates a post holding a reference to the message, with neither room nor recipient set; FAIL = NULL
+struct shardPost * createPost(struct sharedMessage * message)
+{
+	struct shardPost * post = calloc(1, sizeof(struct shardPost));
+	if (post == NULL)
+		return NULL;
+	retainMessage(message);
+	post->message = message;
+	return post;
+}
+
+// pushes the post onto a lock-free inbox, signaling event_fd if the inbox was empty
+void pushPost(struct shardPost * _Atomic * inbox, int event_fd, struct shardPost * post)
+{
+	// lock-free push; any number of shards may post concurrently. The post belongs to the consumer as soon as
+	// it is pushed, so the head it was pushed onto is kept in head
+	struct shardPost * head = atomic_load_explicit(inbox, memory_order_relaxed);
+	do
+		post->next = head;
+	while (!atomic_compare_exchange_weak_explicit(inbox, &head, post, memory_order_release, memory_order_relaxed));
+
+	// only the post that found the inbox empty has to wake the consumer; the others are drained with it
+	if (head == NULL)
+	{
+		uint64_t one = 1;
+		write(event_fd, &one, sizeof(one));
+	}
+}
+
+// queues the relay frame for the shard's peer links, except the link with the specified ID it came from
+void relayOut(struct shard * shard, struct sharedMessage * relay, int source_id)
+{
+	int i;
+	for (i = 0; i < shard->peer_count; i++)
+	{
+		if (shard->peer_list[i]->client_id != source_id)
+			sendMessage(shard->peer_list[i], relay);
+	}
+}
+
+// pushes the message for the specified room onto another shard's inbox, waking the shard if the inbox was empty;
+// relay, if not NULL, goes to the shard's peer links except the one with ID source_id
+void postMessage(struct shard * shard, const char * name, struct sharedMessage * message, struct sharedMessage * relay,
+				 int source_id)
+{
+	struct shardPost * post = createPost(message);
+	if (post == NULL)
+		return;
+	strcpy(post->room, name);
+	if (relay != NULL)
+	{
+		retainMessage(relay);
+		post->relay = relay;
+		post->source_id = source_id;
+	}
+	pushPost(&shard->inbox, shard->event_fd, post);
+}
+
+// pushes the message for a single client of another shard onto the shard's inbox
+void postDirect(struct shard * shard, int client_fd, int client_id, struct sharedMessage * message)
+{
+	struct shardPost * post = createPost(message);
+	if (post == NULL)
+		return;
+	post->client_fd = client_fd;
+	post->client_id = client_id;
+	pushPost(&shard->inbox, shard->event_fd, post);
+}
+
+// hands the message for the specified room to the journal writer, if a journal is kept
+void journalMessage(const char * name, struct sharedMessage * message)
+{
+	struct shardPost * post;
+	if (journal.fd == -1 || (post = createPost(message)) == NULL)
+		return;
+	strcpy(post->room, name);
+	pushPost(&journal.inbox, journal.event_fd, post);
+}
+
+// queues the message for the shard's client with the specified FD, unless that client has left and the FD was
+// reused by another one
+void deliverDirect(struct shard * shard, int client_fd, int client_id, struct sharedMessage * message)
+{
+	struct clientData * client_info = (client_fd < shard->client_table_size) ? shard->client_table[client_fd] : NULL;
+	if (client_info != NULL && client_info->client_id == client_id && client_info->state == CLIENT_ACTIVE)
+		sendMessage(client_info, message);
+}
+
+// takes every post from the shard's inbox and fans its message out to the shard's clients in posting order
+void drainInbox(struct shard * shard)
+{
+	uint64_t count;
+	read(shard->event_fd, &count, sizeof(count));
+
+	// the shard is the only consumer, so taking the whole stack at once is safe
+	struct shardPost * post = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+
+	// reverse the stack into posting order
+	struct shardPost * ordered = NULL;
+	while (post != NULL)
+	{
+		struct shardPost * next = post->next;
+		post->next = ordered;
+		ordered = post;
+		post = next;
+	}
+
+	while (ordered != NULL)
+	{
+		struct shardPost * next = ordered->next;
+		if ((!shutdown_requested || upgrading) && ordered->client_id != 0)
+			deliverDirect(shard, ordered->client_fd, ordered->client_id, ordered->message);
+		else if (!shutdown_requested || upgrading)
+			fanOut(shard, NULL, ordered->room, ordered->message);
+		if (ordered->relay != NULL)
+		{
+			if (!shutdown_requested)
+				relayOut(shard, ordered->relay, ordered->source_id);
+			releaseMessage(ordered->relay);
+		}
+		releaseMessage(ordered->message);
+		free(ordered);
+		ordered = next;
+	}
+}
+
+// hands the message for the specified room to the shard's clients except the sender, the journal and the inboxes
+// of all other shards, which fan it out to their part of the room; relay, if not NULL, goes to the peer links of
+// every shard except the one with ID source_id. Releases message and relay.
+void spreadMessage(struct shard * shard, struct clientData * sender, const char * name, struct sharedMessage * message,
+				   struct sharedMessage * relay, int source_id)
+{
+	int i;
+	for (i = 0; i < shard_count; i++)
+	{
+		if (&shards[i] != shard)
+			postMessage(&shards[i], name, message, relay, source_id);
+	}
+	journalMessage(name, message);
+	fanOut(shard, sender, name, message);
+	if (relay != NULL)
+	{
+		relayOut(shard, relay, source_id);
+		releaseMessage(relay);
+	}
+	releaseMessage(message);
+}
+
+// Federation: servers started with the same -F key link to each other (-P) in any graph, e.g. a star around a
+// server without users acting as relay. Room messages are relayed over every link, tagged with their origin
+// server, stream and sequence number, and each server drops the copies it has seen (see firstSeen).
+
+// creates the relay frame of a message for peer servers: origin server ID (8 bytes), stream (1 byte), sequence
+// number (8 bytes), hops so far, room name length, room name and text, numbers in network byte order; FAIL = NULL
+struct sharedMessage * createRelay(uint64_t origin, int stream, uint64_t seq, const char * name, const char * text,
+								   int len)
+{
+	int name_len = strlen(name);
+	struct sharedMessage * relay = createMessage(FRAME_RELAY, NULL, RELAY_HEADER_SIZE + name_len + len);
+	if (relay == NULL)
+		return NULL;
+	unsigned char * payload = (unsigned char *)relay->data + FRAME_HEADER_SIZE;
+	origin = htobe64(origin);
+	seq = htobe64(seq);
+	memcpy(payload, &origin, 8);
+	payload[8] = (unsigned char)stream;
+	memcpy(payload + 9, &seq, 8);
+	payload[17] = 0;
+	payload[18] = (unsigned char)name_len;
+	memcpy(payload + RELAY_HEADER_SIZE, name, name_len);
+	memcpy(payload + RELAY_HEADER_SIZE + name_len, text, len);
+	return relay;
+}
+
+// writes the specified text to every client in the sender's room except the sender, on this server and, with
+// federation, on every peer server; the frame is built once and shared by everything that sends it. Each shard
+// numbers its own relays: a shard's messages reach every peer link in the order they were numbered, while the
+// messages of different shards interleave.
+void broadcast(struct clientData * sender, const char * text)
+{
+	struct sharedMessage * message;
+	struct sharedMessage * relay = NULL;
+	int len = strlen(text);
+	if (sender->room == NULL)
+		return;
+	message = createMessage(FRAME_TEXT, text, len);
+	if (message == NULL)
+		return;
+	if (federation_key != NULL)
+		relay = createRelay(server_id, sender->shard->index, ++sender->shard->relay_seq, sender->room->name, text, len);
+	spreadMessage(sender->shard, sender, sender->room->name, message, relay, 0);
+}
+
+// checks whether a relayed message with the specified origin, stream and sequence number arrived before. Every
+// link carries a stream in order, so a stream's messages only arrive out of order when they take different paths;
+// the last RELAY_WINDOW sequence numbers of each stream are remembered, and an older message can not be told
+// apart from a copy.
+int firstSeen(uint64_t origin, int stream, uint64_t seq)
+{
+	struct relayStream * entry = NULL;
+	uint64_t time = now();
+	int result = RELAY_NEW;
+	int i;
+
+	pthread_mutex_lock(&stream_lock);
+	for (i = 0; i < stream_count && (streams[i].origin != origin || streams[i].stream != stream); i++)
+		;
+	if (i < stream_count)
+	{
+		entry = &streams[i];
+		if (seq > entry->newest)
+		{
+			entry->window = (seq - entry->newest >= RELAY_WINDOW) ? 1 : (entry->window << (seq - entry->newest)) | 1;
+			entry->newest = seq;
+		}
+		else if (entry->newest - seq >= RELAY_WINDOW)
+			result = RELAY_STALE;
+		else if (entry->window & (1ull << (entry->newest - seq)))
+			result = RELAY_COPY;
+		else
+			entry->window |= 1ull << (entry->newest - seq);
+	}
+	else
+	{
+		// a new stream replaces the one heard from least recently once the table is full
+		if (stream_count < MAX_STREAMS)
+			entry = &streams[stream_count++];
+		else
+		{
+			entry = &streams[0];
+			for (i = 1; i < MAX_STREAMS; i++)
+			{
+				if (streams[i].last_seen < entry->last_seen)
+					entry = &streams[i];
+			}
+		}
+		entry->origin = origin;
+		entry->stream = stream;
+		entry->newest = seq;
+		entry->window = 1;
+	}
+	entry->last_seen = time;
+	pthread_mutex_unlock(&stream_lock);
+	return result;
+}
+
+// handles a message relayed by a peer server: unless it was seen before, it goes to the members of its room on
+// every shard and on to the other peer links; returns -1 if the relay is malformed
+int handleRelay(struct clientData * client_info, const unsigned char * payload, int len)
+{
+	struct shard * shard = client_info->shard;
+	char name[MAX_ROOM_NAME + 1];
+	uint64_t origin, seq;
+
+	if (len < RELAY_HEADER_SIZE || payload[18] > MAX_ROOM_NAME || len < RELAY_HEADER_SIZE + payload[18])
+		return -1;
+	memcpy(name, payload + RELAY_HEADER_SIZE, payload[18]);
+	name[payload[18]] = '\0';
+	if (!validRoomName(name))
+		return -1;
+	memcpy(&origin, payload, 8);
+	memcpy(&seq, payload + 9, 8);
+	origin = be64toh(origin);
+	seq = be64toh(seq);
+
+	// copies come back around loops in the graph of links
+	if (origin == server_id || payload[17] >= MAX_RELAY_HOPS)
+	{
+		counterAdd(&shard->stats.relay_drops, 1);
+		return 0;
+	}
+	switch (firstSeen(origin, payload[8], seq))
+	{
+		case RELAY_COPY:
+			counterAdd(&shard->stats.relay_drops, 1);
+			return 0;
+		case RELAY_STALE:
+			counterAdd(&shard->stats.relay_stale, 1);
+			return 0;
+	}
+	const char * text = (const char *)payload + RELAY_HEADER_SIZE + payload[18];
+	int text_len = len - RELAY_HEADER_SIZE - payload[18];
+	struct sharedMessage * message = createMessage(FRAME_TEXT, text, text_len);
+	if (message == NULL)
+		return 0;
+	struct sharedMessage * relay = createMessage(FRAME_RELAY, (const char *)payload, len);
+	if (relay != NULL)
+		relay->data[FRAME_HEADER_SIZE + 17]++;
+	spreadMessage(shard, NULL, name, message, relay, client_info->client_id);
+	counterAdd(&shard->stats.relayed, 1);
+	logMessage(LOG_CHAT, "%.*s", text_len, text);
+	return 0;
+}
+
+// handles the first frame of a peer server linking to this server, holding its ID and the federation key; returns
+// -1 if the link is refused
+int handlePeer(struct clientData * client_info, const char * payload, int len)
+{
+	uint64_t id;
+	if (federation_key == NULL || len != 8 + (int)strlen(federation_key) ||
+		memcmp(payload + 8, federation_key, len - 8) != 0)
+	{
+		logMessage(LOG_WARN, "[SERVER] Refused a peer server with the wrong federation key.\n");
+		return -1;
+	}
+	memcpy(&id, payload, 8);
+	if (be64toh(id) == server_id)
+		return -1;
+	endHandshake(client_info);
+	addPeer(client_info);
+	logMessage(LOG_INFO, "[SERVER] A peer server has linked.\n");
+	return 0;
+}
+
+// moves the client into the room with the specified name, announcing it in the old and the new room
+void changeRoom(struct clientData * client_info, const char * name)
+{
+	char buffer[MAX_BUFFER_SIZE];
+
+	snprintf(buffer, sizeof(buffer), "[SERVER] Client (%s) has left #%s.\n", client_info->username,
+			 client_info->room->name);
+	broadcast(client_info, buffer);
+
+	// the registry entry is replaced to show the new room
+	recordChange(client_info->shard, 1, client_info);
+	exitRoom(client_info);
+	enterRoom(client_info, name);
+	recordChange(client_info->shard, 0, client_info);
+	replayHistory(client_info, replay_length);
+
+	snprintf(buffer, sizeof(buffer), "[SERVER] Client (%s) has joined #%s.\n", client_info->username, name);
+	broadcast(client_info, buffer);
+	logMessage(LOG_INFO, "%s", buffer);
+}
+
+// sends the client the list of members of all shards, read from the current registry snapshot; a long list is
+// split into several frames, each within the limit of what clients read
+void sendMemberList(struct clientData * client_info)
+{
+	struct registrySnapshot * snapshot = atomic_load(&registry);
+	int count = snapshot ? snapshot->count : 0;
+	int buffer_size = MAX_FRAME_PAYLOAD + 1;
+	int len, i;
+
+	char * buffer = malloc(buffer_size);
+	if (buffer == NULL)
+		return;
+	len = snprintf(buffer, buffer_size, "\n--- %d CLIENT(S) CONNECTED ---\n\n", count);
+	for (i = 0; i < count; i++)
+	{
+		// a member line is shorter than the member itself, the spare bytes leave room for the closing newlines
+		if (len + (int)sizeof(struct member) + 8 > MAX_FRAME_PAYLOAD)
+		{
+			sendText(client_info, buffer);
+			len = 0;
+		}
+		len += snprintf(buffer + len, buffer_size - len, "(%s) in #%s\n", snapshot->members[i].username,
+						snapshot->members[i].room);
+	}
+	snprintf(buffer + len, buffer_size - len, "\n\n");
+	sendText(client_info, buffer);
+	free(buffer);
+}
+
+// sends the client the counters and latency histograms of all shards; rates cover the time since the last /stats
+void sendStats(struct clientData * client_info)
+{
+	struct shardStats * total = calloc(1, sizeof(struct shardStats));
+	int buffer_size = 2048 + shard_count * 128;
+	char * buffer = malloc(buffer_size);
+	unsigned long long totals[4];
+	double rates[4];
+	int len, i;
+
+	if (total == NULL || buffer == NULL)
+	{
+		free(total);
+		free(buffer);
+		return;
+	}
+
+	// add up the shards; their threads keep writing while this reads
+	for (i = 0; i < shard_count; i++)
+	{
+		struct shardStats * stats = &shards[i].stats;
+		counterAdd(&total->clients, counterGet(&stats->clients));
+		counterAdd(&total->connections, counterGet(&stats->connections));
+		counterAdd(&total->messages_in, counterGet(&stats->messages_in));
+		counterAdd(&total->bytes_in, counterGet(&stats->bytes_in));
+		counterAdd(&total->messages_out, counterGet(&stats->messages_out));
+		counterAdd(&total->bytes_out, counterGet(&stats->bytes_out));
+		counterAdd(&total->queued_messages, counterGet(&stats->queued_messages));
+		counterAdd(&total->queued_bytes, counterGet(&stats->queued_bytes));
+		counterAdd(&total->dropped, counterGet(&stats->dropped));
+		counterAdd(&total->slow_disconnects, counterGet(&stats->slow_disconnects));
+		counterAdd(&total->handshake_timeouts, counterGet(&stats->handshake_timeouts));
+		counterAdd(&total->throttled, counterGet(&stats->throttled));
+		counterAdd(&total->flood_drops, counterGet(&stats->flood_drops));
+		counterAdd(&total->flood_disconnects, counterGet(&stats->flood_disconnects));
+		counterAdd(&total->peers, counterGet(&stats->peers));
+		counterAdd(&total->relayed, counterGet(&stats->relayed));
+		counterAdd(&total->relay_drops, counterGet(&stats->relay_drops));
+		counterAdd(&total->relay_stale, counterGet(&stats->relay_stale));
+		histogramMerge(&total->handle_latency, &stats->handle_latency);
+		histogramMerge(&total->fanout_latency, &stats->fanout_latency);
+	}
+
+	// rates since the previous /stats by any client
+	totals[0] = counterGet(&total->messages_in);
+	totals[1] = counterGet(&total->bytes_in);
+	totals[2] = counterGet(&total->messages_out);
+	totals[3] = counterGet(&total->bytes_out);
+	pthread_mutex_lock(&stats_lock);
+	uint64_t time = now();
+	double seconds = (time - (last_stats_time ? last_stats_time : start_time)) / 1e9;
+	for (i = 0; i < 4; i++)
+	{
+		rates[i] = (seconds > 0) ? (totals[i] - last_stats[i]) / seconds : 0;
+		last_stats[i] = totals[i];
+	}
+	last_stats_time = time;
+	pthread_mutex_unlock(&stats_lock);
+
+	len = snprintf(buffer, buffer_size, "\n--- SERVER STATS (up %.0f s, %d thread(s), rates over %.1f s) ---\n\n",
+				   (time - start_time) / 1e9, shard_count, seconds);
+	len += snprintf(buffer + len, buffer_size - len, "Clients:      %llu connected, %llu accepted, %llu timed out "
+					"in handshake\n", counterGet(&total->clients), counterGet(&total->connections),
+					counterGet(&total->handshake_timeouts));
+	len += snprintf(buffer + len, buffer_size - len, "Messages in:  %llu (%.1f/s), %llu bytes (%.1f KB/s)\n",
+					totals[0], rates[0], totals[1], rates[1] / 1000);
+	len += snprintf(buffer + len, buffer_size - len, "Messages out: %llu (%.1f/s), %llu bytes (%.1f KB/s)\n",
+					totals[2], rates[2], totals[3], rates[3] / 1000);
+	len += snprintf(buffer + len, buffer_size - len, "Queued:       %llu messages, %llu bytes\n",
+					counterGet(&total->queued_messages), counterGet(&total->queued_bytes));
+	len += snprintf(buffer + len, buffer_size - len, "Dropped:      %llu messages, %llu slow clients disconnected\n",
+					counterGet(&total->dropped), counterGet(&total->slow_disconnects));
+	len += snprintf(buffer + len, buffer_size - len, "Throttled:    %llu times, %llu messages dropped, %llu flooding "
+					"clients disconnected\n", counterGet(&total->throttled), counterGet(&total->flood_drops),
+					counterGet(&total->flood_disconnects));
+	len += snprintf(buffer + len, buffer_size - len, "Log:          %llu lines dropped\n", logDropped());
+	if (federation_key != NULL)
+		len += snprintf(buffer + len, buffer_size - len, "Federation:   %llu peer links, %llu messages relayed in, %llu "
+						"copies dropped, %llu dropped as too old\n", counterGet(&total->peers),
+						counterGet(&total->relayed), counterGet(&total->relay_drops), counterGet(&total->relay_stale));
+	if (journal_path != NULL)
+		len += snprintf(buffer + len, buffer_size - len, "Journal:      %llu messages in %llu commits, %llu failed, "
+						"commit p50 %.1f us, p99 %.1f us\n", counterGet(&journal.records),
+						counterGet(&journal.commits), counterGet(&journal.failures),
+						histogramPercentile(&journal.commit_latency, 50) / 1e3,
+						histogramPercentile(&journal.commit_latency, 99) / 1e3);
+	len += snprintf(buffer + len, buffer_size - len,
+					"Handling:     p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+					histogramPercentile(&total->handle_latency, 50) / 1e3,
+					histogramPercentile(&total->handle_latency, 99) / 1e3,
+					histogramPercentile(&total->handle_latency, 99.9) / 1e3,
+					counterGet(&total->handle_latency.max) / 1e3);
+	len += snprintf(buffer + len, buffer_size - len,
+					"Fan-out:      p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+					histogramPercentile(&total->fanout_latency, 50) / 1e3,
+					histogramPercentile(&total->fanout_latency, 99) / 1e3,
+					histogramPercentile(&total->fanout_latency, 99.9) / 1e3,
+					counterGet(&total->fanout_latency.max) / 1e3);
+	if (shard_count > 1)
+	{
+		len += snprintf(buffer + len, buffer_size - len, "\n");
+		for (i = 0; i < shard_count; i++)
+			len += snprintf(buffer + len, buffer_size - len,
+							"Thread %d:     %llu clients, %llu in, %llu out, %llu queued\n", i,
+							counterGet(&shards[i].stats.clients), counterGet(&shards[i].stats.messages_in),
+							counterGet(&shards[i].stats.messages_out), counterGet(&shards[i].stats.queued_messages));
+	}
+	snprintf(buffer + len, buffer_size - len, "\n\n");
+	sendText(client_info, buffer);
+	free(buffer);
+	free(total);
+}
+
+// handles the first frame of a client, which contains its username
+void handleUsername(struct clientData * client_info, char * name)
+{
+	char buffer[MAX_BUFFER_SIZE];
+
+	// the handshake is complete
+	endHandshake(client_info);
+	client_info->state = CLIENT_ACTIVE;
+
+	// set client's username
+	bzero(client_info->username, 100);
+	snprintf(client_info->username, sizeof(client_info->username), "#%i: %.80s", client_info->client_id, name);
+
+	// send client a reply, acknowledging connect
+	snprintf(buffer, sizeof(buffer), "Welcome to the chat server, (%s)!\nYou are in #%s. Type a message and press "
+			 "ENTER to send.\n", client_info->username, DEFAULT_ROOM);
+	sendText(client_info, buffer);
+
+	// add client to the default room and the registry
+	enterRoom(client_info, DEFAULT_ROOM);
+	recordChange(client_info->shard, 0, client_info);
+	replayHistory(client_info, replay_length);
+
+	// print message about new client
+	logMessage(LOG_INFO, "A new client has connected! (%s)\n", client_info->username);
+}
+
+// disconnects the client once its messages are sent, telling its room (/exit, /part, /quit)
+void commandQuit(struct clientData * client_info, char * argument)
+{
+	char buffer[MAX_BUFFER_SIZE];
+	snprintf(buffer, sizeof(buffer), "[SERVER] Client (%s) has disconnected.\n", client_info->username);
+	broadcast(client_info, buffer);
+	logMessage(LOG_INFO, "%s", buffer);
+	sendFrame(client_info, FRAME_CLIENT_KILL, NULL, 0);
+	markClosing(client_info);
+}
+
+// sends a random ASCII kirby to the client's room and shows it to the client (/kirby)
+void commandKirby(struct clientData * client_info, char * argument)
+{
+	static const char * kirbys[] = { "<('.')>", "<(^.^)>", "<(^.^<)", "(>^.^)>", "<('O')>" };
+	char buffer[MAX_BUFFER_SIZE];
+
+	// randomly determine which ASCII kirby to send :)
+	const char * kirby = kirbys[rand() % 5];
+	snprintf(buffer, sizeof(buffer), "(%s): %s\n", client_info->username, kirby);
+	broadcast(client_info, buffer);
+	logMessage(LOG_CHAT, "%s", buffer);
+	snprintf(buffer, sizeof(buffer), "You sent a Kirby! --> %s\n", kirby);
+	sendText(client_info, buffer);
+}
+
+// moves the client to the specified room (/join), or back to the default room (/leave, argument NULL)
+void commandJoin(struct clientData * client_info, char * argument)
+{
+	char buffer[MAX_BUFFER_SIZE];
+	const char * name = argument;
+	if (name != NULL && name[0] == '#')
+		name++;
+	if (!validRoomName(name))
+		snprintf(buffer, sizeof(buffer), "[SERVER] Invalid room name. Use up to %d letters, digits, '-' or '_'.\n\n",
+				 MAX_ROOM_NAME);
+	else if (strcmp(name, client_info->room->name) == 0)
+		snprintf(buffer, sizeof(buffer), "[SERVER] You are already in #%s.\n", name);
+	else if (openRoom(client_info->shard, name) == NULL)
+		snprintf(buffer, sizeof(buffer), "[SERVER] Too many rooms are in use, #%s can not be opened.\n\n", name);
+	else
+	{
+		changeRoom(client_info, name);
+		snprintf(buffer, sizeof(buffer), "[SERVER] You are now in #%s.\n", name);
+	}
+	sendText(client_info, buffer);
+}
+
+// sends text to a single client, looked up by name or #id in the registry index; a client on another shard gets
+// it through that shard's inbox instead of a broadcast (/msg)
+void commandMsg(struct clientData * client_info, char * argument)
+{
+	struct registrySnapshot * snapshot = atomic_load(&registry);
+	char * text = argument ? strchr(argument, ' ') : NULL;
+	char buffer[MAX_BUFFER_SIZE];
+	int found[2];
+	int count;
+
+	if (text == NULL || text[1] == '\0')
+	{
+		sendText(client_info, "[SERVER] Invalid message. Use '/msg <name or #id> <text>'.\n\n");
+		return;
+	}
+	*text++ = '\0';
+	count = snapshot ? findMembers(snapshot, argument, found, 2) : 0;
+	if (count != 1)
+	{
+		if (count == 0)
+			snprintf(buffer, sizeof(buffer), "[SERVER] No client named %.80s is connected.\n\n", argument);
+		else
+			snprintf(buffer, sizeof(buffer), "[SERVER] Several clients are named %.80s. Use '/msg #<id> <text>' "
+					 "to pick one (see /who).\n\n", argument);
+		sendText(client_info, buffer);
+		return;
+	}
+	struct member * member = &snapshot->members[found[0]];
+
+	// frame the text once for the recipient, then echo it to the sender
+	int buffer_size = strlen(text) + MAX_PREFIX_SIZE;
+	char * payload = malloc(buffer_size);
+	if (payload == NULL)
+		return;
+	snprintf(payload, buffer_size, "[PM from (%s)]: %s\n", client_info->username, text);
+	struct sharedMessage * message = createMessage(FRAME_TEXT, payload, strlen(payload));
+	if (message != NULL)
+	{
+		if (&shards[member->shard] == client_info->shard)
+			deliverDirect(client_info->shard, member->client_fd, member->client_id, message);
+		else
+			postDirect(&shards[member->shard], member->client_fd, member->client_id, message);
+		releaseMessage(message);
+	}
+	snprintf(payload, buffer_size, "[PM to (%s)]: %s\n", member->username, text);
+	sendText(client_info, payload);
+	free(payload);
+}
+
+// returns the client to the default room (/leave)
+void commandLeave(struct clientData * client_info, char * argument)
+{
+	commandJoin(client_info, DEFAULT_ROOM);
+}
+
+// replays the requested amount of recent messages of the client's room, everything kept by default (/history)
+void commandHistory(struct clientData * client_info, char * argument)
+{
+	char buffer[MAX_BUFFER_SIZE];
+	int count = argument ? atoi(argument) : HISTORY_LENGTH;
+	if (count <= 0)
+	{
+		sendText(client_info, "[SERVER] Invalid message count. Use '/history <n>' with n > 0.\n\n");
+		return;
+	}
+	snprintf(buffer, sizeof(buffer), "[SERVER] Last messages of #%s:\n", client_info->room->name);
+	sendText(client_info, buffer);
+	replayHistory(client_info, count);
+}
+
+// reports server counters (/stats)
+void commandStats(struct clientData * client_info, char * argument)
+{
+	sendStats(client_info);
+}
+
+// lists members of all shards (/who)
+void commandWho(struct clientData * client_info, char * argument)
+{
+	sendMemberList(client_info);
+}
+
+void commandMan(struct clientData * client_info, char * argument);
+
+// command registry, sorted by name at startup (see initCommands) and searched with bsearch; /man lists the
+// commands in this order
+struct command
+{
+	const char * name;										/* command typed after '/' */
+	const char * usage;										/* arguments shown by /man */
+	const char * help;										/* description shown by /man */
+	void (* handler)(struct clientData * client_info, char * argument);	/* handler, argument NULL if none given */
+} commands[] = {
+	{ "exit", "", "Disconnects from chat server and exits.", commandQuit },
+	{ "part", "", "Disconnects from chat server and exits.", commandQuit },
+	{ "quit", "", "Disconnects from chat server and exits.", commandQuit },
+	{ "join", " <room>", "Leaves your room and joins (or creates) the specified room.", commandJoin },
+	{ "leave", "", "Leaves your room and returns to #" DEFAULT_ROOM ".", commandLeave },
+	{ "history", " [n]", "Shows the last n messages of your room.", commandHistory },
+	{ "who", "", "Lists all connected clients and their rooms.", commandWho },
+	{ "msg", " <user> <text>", "Sends text only to the client with the specified name or #id.", commandMsg },
+	{ "stats", "", "Shows server counters and latencies.", commandStats },
+	{ "man", "", "Well, you made it here, didn't you?", commandMan },
+	{ "kirby", "", "Try it. You know you want to. :)", commandKirby },
+};
+#define COMMAND_COUNT (int)(sizeof(commands) / sizeof(commands[0]))	/* define number of registered commands */
+char * manual;												/* /man text, generated from commands */
+
+// prints the list of valid commands (/man)
+void commandMan(struct clientData * client_info, char * argument)
+{
+	sendText(client_info, manual);
+}
+
+// orders commands by name for bsearch
+int compareCommands(const void * a, const void * b)
+{
+	return strcmp(((const struct command *)a)->name, ((const struct command *)b)->name);
+}
+
+// sorts the command registry and generates the /man text from it
+void initCommands()
+{
+	int size = MAX_BUFFER_SIZE;
+	int len, i;
+
+	qsort(commands, COMMAND_COUNT, sizeof(struct command), compareCommands);
+	for (i = 0; i < COMMAND_COUNT; i++)
+		size += strlen(commands[i].name) + strlen(commands[i].usage) + strlen(commands[i].help) + 8;
+	manual = malloc(size);
+	if (manual == NULL)
+		error("[SERVER] ERROR: Out of memory.\n");
+	len = snprintf(manual, size, "\n--- CHAT CLIENT COMMANDS ---\n\n");
+	for (i = 0; i < COMMAND_COUNT; i++)
+		len += snprintf(manual + len, size - len, "/%s%s --> %s\n", commands[i].name, commands[i].usage,
+						commands[i].help);
+	snprintf(manual + len, size - len, "\n\n");
+}
+
+// handles a complete text message received from a named client
+void handleMessage(struct clientData * client_info, char * text, int len)
+{
+	// check if text contains a command, else write contents to all connected clients
+	if (text[0] == '/')
+	{
+		// split the command name from its argument, if any, and look it up in the registry
+		struct command key;
+		char * argument = strchr(&text[1], ' ');
+		if (argument != NULL)
+			*argument++ = '\0';
+		key.name = &text[1];
+		struct command * command = bsearch(&key, commands, COMMAND_COUNT, sizeof(struct command), compareCommands);
+		if (command != NULL)
+			command->handler(client_info, argument);
+		else
+			sendText(client_info, "[SERVER] Invalid command. Use '/man' for a list of valid commands.\n\n");
+		return;
+	}
+
+	// prepend username so clients can identify sender; large enough for the message plus username and decoration,
+	// which keeps the frame within MAX_FRAME_PAYLOAD
+	int buffer_size = len + MAX_PREFIX_SIZE;
+	char * buffer = malloc(buffer_size);
+	if (buffer == NULL)
+		return;
+	snprintf(buffer, buffer_size, "(%s): %s\n", client_info->username, text);
+	broadcast(client_info, buffer);
+
+	// echo message on server console; the logger thread writes it
+	logMessage(LOG_CHAT, "%s", buffer);
+	free(buffer);
+}
+
+// handles a complete frame received from the client; returns -1 if the client broke the protocol
+int handleFrame(struct clientData * client_info, int type, char * payload, int len)
+{
+	// the first frame of a client must be its username, or the hello of a peer server, every later frame is chat
+	// text; a peer link only carries relayed messages
+	if (client_info->state == CLIENT_HANDSHAKE)
+	{
+		if (type == FRAME_PEER)
+			return handlePeer(client_info, payload, len);
+		if (type != FRAME_USERNAME)
+			return -1;
+		handleUsername(client_info, payload);
+	}
+	else if (client_info->state == CLIENT_PEER)
+	{
+		if (type == FRAME_RELAY)
+			return handleRelay(client_info, (unsigned char *)payload, len);
+		if (type != FRAME_ACCEPTED || client_info->peer_server == -1)
+			return -1;
+		peer_servers[client_info->peer_server].backoff = 0;
+		logMessage(LOG_INFO, "[SERVER] Linked to peer server %s.\n", peer_servers[client_info->peer_server].name);
+	}
+	else if (type == FRAME_TEXT)
+		handleMessage(client_info, payload, len);
+	else
+		return -1;
+	return 0;
+}
+
+// results of throttleFrame
+#define THROTTLE_PASS 0			/* the frame may be handled */
+#define THROTTLE_WAIT 1			/* the frame waits in the read buffer until the buckets refill */
+#define THROTTLE_DROP 2			/* the frame is dropped, too many frames are waiting */
+
+// refills the client's token buckets and takes the tokens for a frame of the specified size, with backlog bytes of
+// frames (this one included) received but not yet handled. A bucket may go into debt, so a frame larger than a
+// bucket still passes once the bucket is not empty.
+int throttleFrame(struct clientData * client_info, int size, int backlog)
+{
+	struct shard * shard = client_info->shard;
+	uint64_t time = now();
+	double seconds = (time - client_info->tokens_updated) / 1e9;
+	double wait = 0;
+
+	// buckets hold up to one second of traffic
+	client_info->tokens_updated = time;
+	if (message_rate > 0 && (client_info->message_tokens += seconds * message_rate) > message_rate)
+		client_info->message_tokens = message_rate;
+	if (byte_rate > 0 && (client_info->byte_tokens += seconds * byte_rate) > byte_rate)
+		client_info->byte_tokens = byte_rate;
+
+	if ((message_rate == 0 || client_info->message_tokens > 0) && (byte_rate == 0 || client_info->byte_tokens > 0))
+	{
+		client_info->message_tokens -= 1;
+		client_info->byte_tokens -= size;
+		return THROTTLE_PASS;
+	}
+
+	// wait until both buckets have tokens again, as long as not too much is waiting
+	if (backlog <= THROTTLE_BACKLOG)
+	{
+		if (message_rate > 0 && client_info->message_tokens <= 0)
+			wait = (1 - client_info->message_tokens) / message_rate;
+		if (byte_rate > 0 && client_info->byte_tokens <= 0 && (1 - client_info->byte_tokens) / byte_rate > wait)
+			wait = (1 - client_info->byte_tokens) / byte_rate;
+		client_info->resume_time = time + (uint64_t)(wait * 1e9);
+		if (client_info->throttle_index == -1)
+		{
+			counterAdd(&shard->stats.throttled, 1);
+			addThrottled(client_info);
+		}
+		return THROTTLE_WAIT;
+	}
+
+	// drop the oldest waiting frame, and give up on a client that keeps flooding
+	client_info->flood_drops++;
+	counterAdd(&shard->stats.flood_drops, 1);
+	if (flood_limit > 0 && client_info->flood_drops >= flood_limit)
+	{
+		logMessage(LOG_WARN, "[SERVER] Client (%s) is flooding, disconnecting.\n", client_info->username);
+		counterAdd(&shard->stats.flood_disconnects, 1);
+		sendText(client_info, "[SERVER] You are sending too fast and have been disconnected.\n");
+		sendFrame(client_info, FRAME_CLIENT_KILL, NULL, 0);
+		markClosing(client_info);
+	}
+	return THROTTLE_DROP;
+}
+
+// handles every complete frame in the client's read buffer; returns -1 if the client broke the protocol. Frames
+// over the client's rate wait in the buffer until its token buckets refill; once too many wait, the oldest are
+// dropped, and a client that keeps flooding is disconnected.
+int handleFrames(struct clientData * client_info)
+{
+	int offset = 0;
+	int result = 0;
+
+	while (client_info->read_len - offset >= FRAME_HEADER_SIZE && !client_info->closing)
+	{
+		unsigned char * header = (unsigned char *)client_info->read_buffer + offset;
+		uint32_t len = decodeFrameLength(header);
+		if (len > ((client_info->state == CLIENT_PEER) ? MAX_RELAY_PAYLOAD : MAX_MESSAGE_SIZE))
+		{
+			result = -1;
+			break;
+		}
+
+		// wait for the rest of the frame
+		if ((uint32_t)(client_info->read_len - offset - FRAME_HEADER_SIZE) < len)
+			break;
+
+		// chat text over the client's rate waits for tokens, or is dropped once too much is waiting
+		if (client_info->state == CLIENT_ACTIVE && (message_rate > 0 || byte_rate > 0))
+		{
+			int verdict = throttleFrame(client_info, FRAME_HEADER_SIZE + len, client_info->read_len - offset);
+			if (verdict == THROTTLE_WAIT)
+				break;
+			if (verdict == THROTTLE_DROP)
+			{
+				offset += FRAME_HEADER_SIZE + len;
+				continue;
+			}
+		}
+
+		// terminate payload in place (the buffer always has a spare byte) so it can be used as a string
+		char * payload = (char *)header + FRAME_HEADER_SIZE;
+		char saved = payload[len];
+		payload[len] = '\0';
+		uint64_t handle_start = now();
+		result = handleFrame(client_info, header[0], payload, len);
+		histogramRecord(&client_info->shard->stats.handle_latency, now() - handle_start);
+		counterAdd(&client_info->shard->stats.messages_in, 1);
+		payload[len] = saved;
+		offset += FRAME_HEADER_SIZE + len;
+		if (result == -1)
+			break;
+	}
+
+	// keep only the incomplete remainder
+	memmove(client_info->read_buffer, client_info->read_buffer + offset, client_info->read_len - offset);
+	client_info->read_len -= offset;
+	return result;
+}
+
+// handles the waiting frames of the shard's throttled clients whose buckets have refilled; returns the ms until the
+// next client may resume, or -1 if no client is throttled
+int resumeThrottled(struct shard * shard)
+{
+	uint64_t time = now();
+	uint64_t next = 0;
+	int i;
+
+	// a client resumed here is moved out of the part of the list still to be visited, even if it is throttled again
+	for (i = shard->throttled_count - 1; i >= 0; i--)
+	{
+		struct clientData * client_info = shard->throttled_list[i];
+		if (client_info->resume_time > time)
+			continue;
+		removeThrottled(client_info);
+		if (!client_info->closing && handleFrames(client_info) == -1)
+		{
+			markClosing(client_info);
+			clearQueue(client_info);
+		}
+	}
+
+	for (i = 0; i < shard->throttled_count; i++)
+	{
+		if (next == 0 || shard->throttled_list[i]->resume_time < next)
+			next = shard->throttled_list[i]->resume_time;
+	}
+	if (shard->throttled_count == 0)
+		return -1;
+	return (next > time) ? (int)((next - time + 999999) / 1000000) : 0;
+}
+
+// reads all available data from the client and handles every complete frame; returns -1 if the connection
+// failed. A client that closed its side is marked closing, keeping the replies still queued for it.
+int readClient(struct clientData * client_info)
+{
+	for (;;)
+	{
+		// make room for another read, keeping one spare byte for terminating payloads
+		if (client_info->read_cap - client_info->read_len - 1 < READ_CHUNK_SIZE)
+		{
+			int new_cap = client_info->read_cap ? client_info->read_cap * 2 : 2 * READ_CHUNK_SIZE;
+			char * new_buffer = realloc(client_info->read_buffer, new_cap);
+			if (new_buffer == NULL)
+				return -1;
+			client_info->read_buffer = new_buffer;
+			client_info->read_cap = new_cap;
+		}
+
+		ssize_t n = read(client_info->client_fd, client_info->read_buffer + client_info->read_len,
+						 client_info->read_cap - client_info->read_len - 1);
+		if (n == 0)
+		{
+			markClosing(client_info);
+			return 0;
+		}
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		counterAdd(&client_info->shard->stats.bytes_in, n);
+
+		// handle complete frames; anything sent after a disconnect command is ignored
+		client_info->read_len += n;
+		if (handleFrames(client_info) == -1)
+			return -1;
+		if (client_info->closing)
+			return 0;
+	}
+}
+
+// appends bytes to the client's read buffer; returns -1 if it can not grow
+int appendData(struct clientData * client_info, const char * data, int len)
+{
+	// make room for the data, keeping one spare byte for terminating payloads
+	if (client_info->read_cap - client_info->read_len - 1 < len)
+	{
+		int new_cap = client_info->read_cap ? client_info->read_cap : 2 * READ_CHUNK_SIZE;
+		while (new_cap - client_info->read_len - 1 < len)
+			new_cap *= 2;
+		char * new_buffer = realloc(client_info->read_buffer, new_cap);
+		if (new_buffer == NULL)
+			return -1;
+		client_info->read_buffer = new_buffer;
+		client_info->read_cap = new_cap;
+	}
+	memcpy(client_info->read_buffer + client_info->read_len, data, len);
+	client_info->read_len += len;
+	return 0;
+}
+
+// appends bytes received through io_uring to the client's read buffer and handles every complete frame;
+// returns -1 if the client broke the protocol
+int receiveData(struct clientData * client_info, const char * data, int len)
+{
+	if (appendData(client_info, data, len) == -1)
+		return -1;
+	counterAdd(&client_info->shard->stats.bytes_in, len);
+	return handleFrames(client_info);
+}
+
+// tells a client that the server can not accept it and closes its socket
+void refuseClient(int new_sock_fd)
+{
+	unsigned char header[FRAME_HEADER_SIZE];
+	logMessage(LOG_WARN, "[SERVER] Maximum number of clients connected. New client refused.\n");
+	encodeFrameHeader(header, FRAME_REFUSED, 0);
+	write(new_sock_fd, header, sizeof(header));
+	close(new_sock_fd);
+}
+
+// called when the shard is out of FDs: releases the spare FD to accept and refuse a pending client, so it is not
+// retried forever
+void refuseOverflow(struct shard * shard)
+{
+	int new_sock_fd;
+	if (shard->spare_fd == -1)
+		return;
+	close(shard->spare_fd);
+	new_sock_fd = accept(shard->sock_fd, NULL, NULL);
+	if (new_sock_fd != -1)
+		refuseClient(new_sock_fd);
+	shard->spare_fd = open("/dev/null", O_RDONLY);
+}
+
+// watches the client for input and for room in its socket buffer; with io_uring a multishot receive delivers its
+// input, and room in its socket buffer is only polled for once a write falls short. Returns -1 on failure.
+int watchClient(struct clientData * client_info)
+{
+	struct epoll_event event;
+	if (client_info->shard->ring != NULL)
+	{
+		armRecv(client_info);
+		return 0;
+	}
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.fd = client_info->client_fd;
+	return epoll_ctl(client_info->shard->epoll_fd, EPOLL_CTL_ADD, client_info->client_fd, &event);
+}
+
+// opens links to the servers given with -P that have none, each retried with a growing delay while it fails;
+// returns the ms until the next attempt is due, -1 if none is. Called by shard 0 only.
+int connectPeers(struct shard * shard)
+{
+	uint64_t time = now();
+	int timeout = -1;
+	int i;
+
+	for (i = 0; i < peer_server_count; i++)
+	{
+		struct peerServer * peer = &peer_servers[i];
+		if (peer->link_id == 0 && peer->next_attempt <= time)
+		{
+			// the connection completes in the background; the hello is queued until then
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			struct clientData * client_info = NULL;
+			if (fd != -1 && (connect(fd, (struct sockaddr *)&peer->addr, sizeof(peer->addr)) == 0 ||
+							 errno == EINPROGRESS))
+				client_info = openConnection(shard, fd);
+			if (client_info == NULL)
+			{
+				if (fd != -1)
+					close(fd);
+			}
+			else
+			{
+				client_info->client_id = atomic_fetch_add(&next_client_id, 1);
+				client_info->client_addr = peer->addr;
+				client_info->peer_server = i;
+				addPeer(client_info);
+				peer->link_id = client_info->client_id;
+				if (watchClient(client_info) == -1)
+					closeConnection(client_info);
+				else
+				{
+					int key_len = strlen(federation_key);
+					char * hello = malloc(8 + key_len);
+					uint64_t id = htobe64(server_id);
+					if (hello != NULL)
+					{
+						memcpy(hello, &id, 8);
+						memcpy(hello + 8, federation_key, key_len);
+						sendFrame(client_info, FRAME_PEER, hello, 8 + key_len);
+						free(hello);
+					}
+				}
+			}
+			peer->backoff = peer->backoff ? peer->backoff * 2 : 1000;
+			if (peer->backoff > PEER_BACKOFF_MAX)
+				peer->backoff = PEER_BACKOFF_MAX;
+			peer->next_attempt = time + (uint64_t)peer->backoff * 1000000;
+		}
+		if (peer->link_id == 0)
+		{
+			int wait = (int)((peer->next_attempt - time) / 1000000) + 1;
+			if (timeout == -1 || wait < timeout)
+				timeout = wait;
+		}
+	}
+	return timeout;
+}
+
+// adds a newly accepted connection to the shard, starts watching it and sends the acceptance message;
+// client_addr is NULL if the address is unknown
+void addClient(struct shard * shard, int new_sock_fd, struct sockaddr_in * client_addr)
+{
+	// update client_table and client_list
+	struct clientData * client_info = openConnection(shard, new_sock_fd);
+
+	// check if there is room for new client and add client if true
+	if (client_info == NULL)
+	{
+		refuseClient(new_sock_fd);
+		return;
+	}
+
+	// update clientData for new client
+	client_info->client_id = atomic_fetch_add(&next_client_id, 1);
+	if (client_addr != NULL)
+		client_info->client_addr = *client_addr;
+	client_info->server_addr = server_addr;
+	if (watchClient(client_info) == -1)
+	{
+		closeConnection(client_info);
+		return;
+	}
+
+	// send acceptance message to client; its username is read by the event loop before the deadline
+	startHandshake(client_info);
+	sendFrame(client_info, FRAME_ACCEPTED, NULL, 0);
+}
+
+// accepts up to ACCEPT_BATCH pending connections on the shard's listening socket; the listener stays readable
+// while more are pending, so a connection storm is taken in batches between serving the connected clients
+void acceptClients(struct shard * shard)
+{
+	struct sockaddr_in client_addr;							/* client address */
+	socklen_t client_addr_len;								/* client address length */
+	int new_sock_fd;										/* new connection FD */
+	int accepted;											/* connections accepted in this batch */
+
+	for (accepted = 0; accepted < ACCEPT_BATCH; accepted++)
+	{
+		// new sockets are created non-blocking, saving a fcntl round trip per client
+		client_addr_len = sizeof(client_addr);
+		new_sock_fd = accept4(shard->sock_fd, (struct sockaddr *)&client_addr, &client_addr_len,
+							  SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_sock_fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if ((errno == EMFILE || errno == ENFILE) && shard->spare_fd != -1)
+			{
+				refuseOverflow(shard);
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				logMessage(LOG_ERROR, "[SERVER] ERROR: Accept failed.\n");
+			return;
+		}
+		addClient(shard, new_sock_fd, &client_addr);
+	}
+}
+
+// handles the epoll events of the shard's listener, eventfd and clients
+void handleEvents(struct shard * shard, struct epoll_event * events, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		int fd = events[i].data.fd;
+		if (fd == shard->sock_fd)
+		{
+			acceptClients(shard);
+			continue;
+		}
+		if (fd == shard->event_fd)
+		{
+			drainInbox(shard);
+			continue;
+		}
+
+		// skip clients closed earlier in this batch
+		struct clientData * client_info = (fd < shard->client_table_size) ? shard->client_table[fd] : NULL;
+		if (client_info == NULL)
+			continue;
+
+		// send pending data, then handle input
+		if ((events[i].events & EPOLLOUT) && flushClient(client_info) == -1)
+			markClosing(client_info);
+		if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !client_info->closing &&
+			readClient(client_info) == -1)
+		{
+			// client went away without a disconnect command
+			markClosing(client_info);
+			clearQueue(client_info);
+		}
+	}
+}
+
+// handles one completed io_uring request of the shard; a multishot request that ends is armed again
+void handleCompletion(struct shard * shard, struct io_uring_cqe * cqe)
+{
+	struct uring * ring = shard->ring;
+	int kind = (int)(cqe->user_data >> 60);
+	int fd = (int)((cqe->user_data >> 32) & 0x0fffffff);
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	struct clientData * client_info = NULL;
+
+	// count the requests that ended; once the server stops, they are not armed again
+	if (kind == REQUEST_POLL || (!more && (kind == REQUEST_ACCEPT || kind == REQUEST_EVENT || kind == REQUEST_RECV)))
+		ring->armed--;
+
+	if (kind == REQUEST_ACCEPT)
+	{
+		if (cqe->res >= 0)
+			addClient(shard, cqe->res, NULL);
+		else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+			refuseOverflow(shard);
+		if (!more && !shutdown_requested)
+			armAccept(shard);
+		return;
+	}
+	if (kind == REQUEST_EVENT)
+	{
+		drainInbox(shard);
+		if (!more && !shutdown_requested)
+			armEvents(shard);
+		return;
+	}
+	if (kind == REQUEST_CANCEL)
+		return;
+
+	// requests of a closed client may complete after its FD was reused, but carry the old client's ID
+	if (fd < shard->client_table_size && shard->client_table[fd] != NULL &&
+		shard->client_table[fd]->client_id == (int)(uint32_t)cqe->user_data)
+		client_info = shard->client_table[fd];
+
+	if (kind == REQUEST_RECV)
+	{
+		// handle the data unless the client is disconnecting, then give the buffer back
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+		{
+			int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (client_info != NULL && !client_info->closing &&
+				receiveData(client_info, ring->buffer_data + (size_t)id * RECV_BUFFER_SIZE, cqe->res) == -1)
+			{
+				markClosing(client_info);
+				clearQueue(client_info);
+			}
+			recycleBuffer(ring, id);
+		}
+		else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED && client_info != NULL && !client_info->closing)
+		{
+			// client went away without a disconnect command; after a clean end of input its replies are still sent
+			markClosing(client_info);
+			if (cqe->res != 0)
+				clearQueue(client_info);
+		}
+
+		// the receive also ends when the provided buffers run out; they are back by now
+		if (!more && client_info != NULL && !client_info->closing && !shutdown_requested)
+			armRecv(client_info);
+	}
+	else if (kind == REQUEST_SEND)
+	{
+		ring->sends--;
+		if (client_info == NULL)
+			return;
+		if (cqe->res >= 0)
+			consumeQueue(client_info, cqe->res);
+		else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+		{
+			markClosing(client_info);
+			return;
+		}
+
+		// the socket buffer is full; write the rest once it has room
+		if (client_info->out_count > 0 && !client_info->poll_armed)
+			armPoll(client_info);
+	}
+	else if (kind == REQUEST_POLL && client_info != NULL)
+	{
+		client_info->poll_armed = 0;
+		scheduleFlush(client_info);
+	}
+}
+
+// handles every completed io_uring request of the shard; while collecting, only the results of writes are handled
+// and the others are deferred in arrival order
+void handleCompletions(struct shard * shard)
+{
+	struct uring * ring = shard->ring;
+	while (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe cqe = ring->cqes[*ring->cq_head & ring->cq_mask];
+		__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+		if (!ring->collecting || (int)(cqe.user_data >> 60) == REQUEST_SEND)
+		{
+			handleCompletion(shard, &cqe);
+			continue;
+		}
+		if (ring->deferred_count == ring->deferred_size)
+		{
+			int new_size = ring->deferred_size ? ring->deferred_size * 2 : 64;
+			struct io_uring_cqe * list = realloc(ring->deferred, new_size * sizeof(struct io_uring_cqe));
+			if (list == NULL)
+				error("[SERVER] ERROR: Out of memory.\n");
+			ring->deferred = list;
+			ring->deferred_size = new_size;
+		}
+		ring->deferred[ring->deferred_count++] = cqe;
+	}
+}
+
+// submits one write for every client in the shard's flush_list with a single io_uring_enter, then handles their
+// results. Until all of them are in, other completions are deferred, so no client's queue changes while its write
+// is in flight; handling the deferred completions may queue new messages, which are written in another round.
+void flushRing(struct shard * shard)
+{
+	struct uring * ring = shard->ring;
+	int i;
+
+	while (shard->flush_count > 0)
+	{
+		// grow iov until every client can write MAX_IOVECS messages
+		if (shard->flush_count * MAX_IOVECS > ring->iov_size)
+		{
+			int new_size = shard->flush_list_size * MAX_IOVECS;
+			struct iovec * iov = realloc(ring->iov, new_size * sizeof(struct iovec));
+			if (iov == NULL)
+				error("[SERVER] ERROR: Out of memory.\n");
+			ring->iov = iov;
+			ring->iov_size = new_size;
+		}
+
+		// clients waiting for room in their socket buffer are flushed when their poll completes
+		for (i = 0; i < shard->flush_count; i++)
+		{
+			struct clientData * client_info = shard->flush_list[i];
+			client_info->flush_pending = 0;
+			if (client_info->out_count == 0 || client_info->poll_armed)
+				continue;
+			struct io_uring_sqe * sqe = getSqe(ring);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = client_info->client_fd;
+			sqe->addr = (uint64_t)(uintptr_t)&ring->iov[i * MAX_IOVECS];
+			sqe->len = gatherQueue(client_info, &ring->iov[i * MAX_IOVECS]);
+			sqe->user_data = requestData(REQUEST_SEND, client_info->client_fd, client_info->client_id);
+			ring->sends++;
+		}
+		shard->flush_count = 0;
+
+		ring->collecting = 1;
+		while (ring->sends > 0)
+		{
+			if (enterRing(ring, 1, -1) == -1 && errno != EINTR && errno != EBUSY)
+				error("[SERVER] ERROR: io_uring_enter failed.\n");
+			handleCompletions(shard);
+		}
+		ring->collecting = 0;
+		for (i = 0; i < ring->deferred_count; i++)
+			handleCompletion(shard, &ring->deferred[i]);
+		ring->deferred_count = 0;
+	}
+}
+
+// cancels every request of the shard's ring and handles their last completions, so no received data is left in
+// the ring and nothing more is accepted; called by the shard's thread before its clients are handed over
+void quiesceRing(struct shard * shard)
+{
+	struct uring * ring = shard->ring;
+	struct io_uring_sqe * sqe = getSqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = requestData(REQUEST_CANCEL, 0, 0);
+	while (ring->armed > 0)
+	{
+		if (enterRing(ring, 1, -1) == -1 && errno != EINTR && errno != EBUSY)
+			error("[SERVER] ERROR: io_uring_enter failed.\n");
+		handleCompletions(shard);
+	}
+}
+
+// writes the new messages of every client in the shard's flush_list
+void flushPending(struct shard * shard)
+{
+	int i;
+	if (shard->ring != NULL && !shutdown_requested)
+	{
+		flushRing(shard);
+		return;
+	}
+	for (i = 0; i < shard->flush_count; i++)
+	{
+		shard->flush_list[i]->flush_pending = 0;
+		if (flushClient(shard->flush_list[i]) == -1)
+			markClosing(shard->flush_list[i]);
+	}
+	shard->flush_count = 0;
+}
+
+// creates the shard's listening socket, eventfd and epoll instance; returns -1 on failure
+int openShard(struct shard * shard, int index, int sock_fd)
+{
+	struct epoll_event event;
+	int reuse = 1;
+
+	shard->index = index;
+	atomic_init(&shard->inbox, NULL);
+	shard->rooms = calloc(ROOM_TABLE_SIZE, sizeof(struct room *));
+	if (shard->rooms == NULL)
+		return -1;
+
+	// every shard binds its own socket to the port and the kernel spreads new connections across them; after an
+	// upgrade the old server's sockets are used, so connections waiting in their backlog are kept
+	shard->sock_fd = sock_fd;
+	if (sock_fd == -1)
+	{
+		shard->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (shard->sock_fd < 0)
+			return -1;
+		setsockopt(shard->sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (shard_count > 1 && setsockopt(shard->sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+			return -1;
+		if (bind(shard->sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+			return -1;
+		if (listen(shard->sock_fd, SOMAXCONN) == -1)
+			return -1;
+	}
+	if (setNonBlocking(shard->sock_fd) == -1)
+		return -1;
+
+	// create epoll instance and watch listening socket for new connections and eventfd for posts
+	shard->event_fd = eventfd(0, EFD_NONBLOCK);
+	shard->epoll_fd = epoll_create1(0);
+	if (shard->event_fd == -1 || shard->epoll_fd == -1)
+		return -1;
+	event.events = EPOLLIN;
+	event.data.fd = shard->sock_fd;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->sock_fd, &event) == -1)
+		return -1;
+	event.events = EPOLLIN;
+	event.data.fd = shard->event_fd;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &event) == -1)
+		return -1;
+	shard->spare_fd = open("/dev/null", O_RDONLY);
+	return 0;
+}
+
+// opens every shard, giving shard i the i-th of the specified listening sockets; shards beyond them bind their
+// own, and sockets beyond the shards are closed
+void openShards(int * listeners, int count)
+{
+	int i;
+	for (i = 0; i < shard_count; i++)
+	{
+		if (openShard(&shards[i], i, (i < count) ? listeners[i] : -1) == -1)
+			error("[SERVER] ERROR: Failed to bind socket.\n");
+	}
+	for (; i < count; i++)
+		close(listeners[i]);
+}
+
+// runs the event loop of the specified shard until shutdown is requested
+void * runShard(void * arg)
+{
+	struct shard * shard = arg;
+	struct epoll_event events[MAX_EVENTS];					/* events returned by epoll_wait */
+	int i, n;												/* loop iterator variables */
+	int timeout = -1;										/* ms until the next handshake deadline */
+	int wait;												/* ms until the next throttled client resumes */
+
+	// the ring must be created by the thread submitting to it; without one, the shard falls back to epoll
+	if (use_uring && openRing(shard) == -1)
+		logMessage(LOG_WARN, "[SERVER] io_uring is not available, shard %d uses epoll.\n", shard->index);
+
+	// clients taken over from an old server are watched by the ring instead of epoll once it is set up, and may
+	// have frames and messages waiting
+	atomic_store(&shard->reader_epoch, atomic_load(&registry_epoch));
+	for (i = 0; i < shard->client_count; i++)
+	{
+		struct clientData * client_info = shard->client_list[i];
+		if (shard->ring != NULL)
+			armRecv(client_info);
+		if (client_info->read_len > 0 && handleFrames(client_info) == -1)
+			markClosing(client_info);
+	}
+	if (shard->index == 0)
+		timeout = connectPeers(shard);
+	flushPending(shard);
+	publishRegistry(shard);
+
+	while (!shutdown_requested)
+	{
+		// the shard holds no registry snapshot while waiting, and may use the current one once it wakes up
+		atomic_store(&shard->reader_epoch, 0);
+		if (shard->ring != NULL)
+			n = enterRing(shard->ring, 1, timeout);
+		else
+			n = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, timeout);
+		atomic_store(&shard->reader_epoch, atomic_load(&registry_epoch));
+		if (n == -1 && errno != ETIME && errno != EBUSY)
+		{
+			if (errno == EINTR)
+				continue;
+			error("[SERVER] ERROR: Waiting for events failed.\n");
+		}
+
+		if (shard->ring != NULL)
+			handleCompletions(shard);
+		else
+			handleEvents(shard, events, n);
+
+		// drop clients that did not finish the handshake in time and handle frames that waited for tokens, then
+		// wake up for whatever is due next
+		timeout = expireHandshakes(shard);
+		wait = resumeThrottled(shard);
+		if (wait != -1 && (timeout == -1 || wait < timeout))
+			timeout = wait;
+		wait = (shard->index == 0) ? connectPeers(shard) : -1;
+		if (wait != -1 && (timeout == -1 || wait < timeout))
+			timeout = wait;
+
+		// write the messages queued while handling this batch, one writev per client
+		flushPending(shard);
+
+		// close clients that are disconnecting once their pending data has been sent
+		for (i = shard->closing_count - 1; i >= 0; i--)
+		{
+			struct clientData * client_info = shard->closing_list[i];
+			if (client_info->out_count == 0 || flushClient(client_info) == -1 || client_info->out_count == 0)
+			{
+				if (client_info->state == CLIENT_ACTIVE)
+					logMessage(LOG_INFO, "[SERVER] Connection to client (%s) closed.\n", client_info->username);
+				if (client_info->dropped > 0)
+					logMessage(LOG_WARN, "[SERVER] %d messages to client (%s) were dropped.\n", client_info->dropped,
+							   client_info->username);
+				shard->closing_list[i] = shard->closing_list[--shard->closing_count];
+				closeConnection(client_info);
+			}
+		}
+
+		// publish the joins and leaves of this batch at once
+		publishRegistry(shard);
+	}
+
+	// a ring may hold data received for clients that are handed over
+	if (upgrading && shard->ring != NULL)
+		quiesceRing(shard);
+
+	// wake the other shards so they notice the shutdown too
+	for (i = 0; i < shard_count; i++)
+	{
+		uint64_t one = 1;
+		if (&shards[i] != shard)
+			write(shards[i].event_fd, &one, sizeof(one));
+	}
+	return NULL;
+}
+
+// copies the histories of shard 0's rooms to the other shards, which start out without rooms; returns the amount
+// of rooms
+int copyHistories()
+{
+	struct room * room;
+	int rooms = 0;
+	int i, j;
+
+	for (i = 0; i < ROOM_TABLE_SIZE; i++)
+	{
+		for (room = shards[0].rooms[i]; room != NULL; room = room->next)
+		{
+			for (j = 1; j < shard_count && room->history != NULL; j++)
+			{
+				struct room * copy = openRoom(&shards[j], room->name);
+				if (copy == NULL || (copy->history = malloc(sizeof(struct history))) == NULL)
+					continue;
+				memcpy(copy->history, room->history, sizeof(struct history));
+			}
+			rooms++;
+		}
+	}
+	return rooms;
+}
+
+// replays the records of a mapped journal into the histories of shard 0's rooms, then copies the histories to
+// the other shards; returns the length of the journal up to the first incomplete record
+off_t replayJournal(const unsigned char * data, off_t size)
+{
+	char name[MAX_ROOM_NAME + 1];
+	off_t pos = JOURNAL_MAGIC_SIZE;
+	unsigned long long records = 0;
+
+	// a record cut off by a crash, or never completely written, ends the journal
+	while (pos < size)
+	{
+		int name_len = data[pos];
+		if (name_len == 0 || name_len > MAX_ROOM_NAME || size - pos < 1 + name_len + FRAME_HEADER_SIZE)
+			break;
+		memcpy(name, data + pos + 1, name_len);
+		name[name_len] = '\0';
+		const unsigned char * frame = data + pos + 1 + name_len;
+		uint32_t len = decodeFrameLength(frame);
+		if (!validRoomName(name) || frame[0] != FRAME_TEXT || len > MAX_FRAME_PAYLOAD ||
+			size - pos - 1 - name_len - FRAME_HEADER_SIZE < len)
+			break;
+		struct room * room = openRoom(&shards[0], name);
+		if (room != NULL)
+			recordHistory(room, (const char *)frame, FRAME_HEADER_SIZE + len);
+		pos += 1 + name_len + FRAME_HEADER_SIZE + len;
+		records++;
+	}
+
+	// only the end of the journal is left in the histories, so copying them is cheaper than replaying per shard
+	logMessage(LOG_INFO, "[SERVER] Replayed %llu journal messages into %d rooms.\n", records, copyHistories());
+	return pos;
+}
+
+// opens the journal at the specified path, creating it if needed, and replays it into the rooms' histories unless
+// they were taken over from an old server; the shards must be open, but not yet running
+void openJournal(const char * path, int replay)
+{
+	struct stat info;
+
+	journal.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (journal.fd == -1 || fstat(journal.fd, &info) == -1)
+		error("[SERVER] ERROR: Failed to open journal.\n");
+	if (info.st_size == 0)
+	{
+		if (write(journal.fd, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != JOURNAL_MAGIC_SIZE || fdatasync(journal.fd) == -1)
+			error("[SERVER] ERROR: Failed to write journal.\n");
+		journal.size = JOURNAL_MAGIC_SIZE;
+	}
+	else
+	{
+		// the journal is read straight from the page cache instead of being copied into a buffer
+		const unsigned char * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+		if (data == MAP_FAILED)
+			error("[SERVER] ERROR: Failed to map journal.\n");
+		if (info.st_size < JOURNAL_MAGIC_SIZE || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0)
+			error("[SERVER] ERROR: File is not a journal.\n");
+		madvise((void *)data, info.st_size, MADV_SEQUENTIAL);
+		journal.size = replay ? replayJournal(data, info.st_size) : info.st_size;
+		munmap((void *)data, info.st_size);
+
+		// appending after a torn record would hide every later one from the next replay
+		if (journal.size < info.st_size)
+		{
+			logMessage(LOG_WARN, "[SERVER] Cut %lld bytes of an incomplete record off the journal.\n",
+					   (long long)(info.st_size - journal.size));
+			if (ftruncate(journal.fd, journal.size) == -1)
+				error("[SERVER] ERROR: Failed to truncate journal.\n");
+		}
+	}
+	journal.event_fd = eventfd(0, EFD_CLOEXEC);
+	if (journal.event_fd == -1)
+		error("[SERVER] ERROR: Failed to create eventfd.\n");
+}
+
+// appends the batch of records to the journal and syncs it; a failed write is cut off again, so the journal
+// never ends in a torn record. Returns -1 on failure.
+int commitJournal(const char * batch, size_t len)
+{
+	size_t written = 0;
+	while (written < len)
+	{
+		ssize_t n = write(journal.fd, batch + written, len - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			ftruncate(journal.fd, journal.size);
+			return -1;
+		}
+		written += n;
+	}
+	if (fdatasync(journal.fd) == -1)
+		return -1;
+	journal.size += len;
+	return 0;
+}
+
+// journal writer thread: appends every message posted while the previous commit ran with one write and one
+// fdatasync, so a burst of messages shares a single sync (group commit); exits once stopJournal was called and
+// the inbox is empty
+void * runJournal(void * arg)
+{
+	char * batch = NULL;
+	size_t batch_size = 0;
+	for (;;)
+	{
+		// the writer is the only consumer, so taking the whole stack at once is safe
+		struct shardPost * post = atomic_exchange_explicit(&journal.inbox, NULL, memory_order_acquire);
+		if (post == NULL)
+		{
+			uint64_t count;
+			if (atomic_load(&journal.stopping))
+				break;
+			read(journal.event_fd, &count, sizeof(count));
+			continue;
+		}
+
+		// reverse the stack into posting order, adding up the size of the records
+		struct shardPost * ordered = NULL;
+		unsigned long long records = 0;
+		size_t len = 0;
+		while (post != NULL)
+		{
+			struct shardPost * next = post->next;
+			post->next = ordered;
+			ordered = post;
+			len += 1 + strlen(post->room) + post->message->len;
+			records++;
+			post = next;
+		}
+		if (len > batch_size)
+		{
+			char * new_batch = realloc(batch, len);
+			if (new_batch == NULL)
+				error("[SERVER] ERROR: Out of memory.\n");
+			batch = new_batch;
+			batch_size = len;
+		}
+
+		// serialize the records into one buffer, releasing the messages
+		len = 0;
+		while (ordered != NULL)
+		{
+			struct shardPost * next = ordered->next;
+			int name_len = strlen(ordered->room);
+			batch[len++] = (char)name_len;
+			memcpy(batch + len, ordered->room, name_len);
+			len += name_len;
+			memcpy(batch + len, ordered->message->data, ordered->message->len);
+			len += ordered->message->len;
+			releaseMessage(ordered->message);
+			free(ordered);
+			ordered = next;
+		}
+
+		uint64_t start = now();
+		if (commitJournal(batch, len) == -1)
+		{
+			counterAdd(&journal.failures, 1);
+			logMessage(LOG_ERROR, "[SERVER] ERROR: Failed to write %llu messages to the journal: %s\n", records,
+					   strerror(errno));
+			continue;
+		}
+		histogramRecord(&journal.commit_latency, now() - start);
+		counterAdd(&journal.records, records);
+		counterAdd(&journal.commits, 1);
+	}
+	free(batch);
+	return NULL;
+}
+
+// starts the journal writer thread, if a journal is kept
+void startJournal()
+{
+	if (journal.fd == -1)
+		return;
+	if (pthread_create(&journal.thread, NULL, runJournal, NULL) != 0)
+		error("[SERVER] ERROR: Failed to create thread.\n");
+}
+
+// appends every message still posted to the journal and stops the writer thread
+void stopJournal()
+{
+	uint64_t one = 1;
+	if (journal.fd == -1)
+		return;
+	atomic_store(&journal.stopping, 1);
+	write(journal.event_fd, &one, sizeof(one));
+	pthread_join(journal.thread, NULL);
+	close(journal.fd);
+	journal.fd = -1;
+}
+
+// sends one record of an upgrade, with the specified FD attached unless it is -1; returns -1 on failure
+int sendRecord(int fd, int type, const void * data, int len, int passed_fd)
+{
+	struct handoffRecord record = { type, len };
+	struct iovec iov[2] = { { &record, sizeof(record) }, { (void *)data, len } };
+	union { struct cmsghdr header; char space[CMSG_SPACE(sizeof(int))]; } control;
+	struct msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = iov;
+	message.msg_iovlen = (len > 0) ? 2 : 1;
+	if (passed_fd != -1)
+	{
+		memset(&control, 0, sizeof(control));
+		message.msg_control = control.space;
+		message.msg_controllen = sizeof(control.space);
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+	}
+	return (sendmsg(fd, &message, MSG_NOSIGNAL) == (ssize_t)(sizeof(record) + len)) ? 0 : -1;
+}
+
+// sends the specified bytes as HANDOFF_DATA records; returns -1 on failure
+int sendData(int fd, const char * data, int len)
+{
+	while (len > 0)
+	{
+		int chunk = (len < HANDOFF_RECORD_SIZE) ? len : HANDOFF_RECORD_SIZE;
+		if (sendRecord(fd, HANDOFF_DATA, data, chunk, -1) == -1)
+			return -1;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+// receives one record of an upgrade into data, which holds HANDOFF_RECORD_SIZE bytes, and stores its type and
+// attached FD (-1 if none); returns the length of its data, -1 on failure
+int receiveRecord(int fd, int * type, char * data, int * passed_fd)
+{
+	struct handoffRecord record;
+	struct iovec iov[2] = { { &record, sizeof(record) }, { data, HANDOFF_RECORD_SIZE } };
+	union { struct cmsghdr header; char space[CMSG_SPACE(sizeof(int))]; } control;
+	struct msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = iov;
+	message.msg_iovlen = 2;
+	message.msg_control = control.space;
+	message.msg_controllen = sizeof(control.space);
+	ssize_t n = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+	if (n < (ssize_t)sizeof(record) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+		record.len != n - (ssize_t)sizeof(record))
+		return -1;
+	*type = record.type;
+	*passed_fd = -1;
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+	return record.len;
+}
+
+// receives len bytes sent as HANDOFF_DATA records into target, or into the client's read buffer if target is
+// NULL; returns -1 on failure
+int receiveBytes(int fd, struct clientData * client_info, char * target, int len, char * data)
+{
+	int type, passed_fd;
+	while (len > 0)
+	{
+		int n = receiveRecord(fd, &type, data, &passed_fd);
+		if (n == -1 || type != HANDOFF_DATA || n > len)
+			return -1;
+		if (target != NULL)
+		{
+			memcpy(target, data, n);
+			target += n;
+		}
+		else if (appendData(client_info, data, n) == -1)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+// sends the room's name and the frames of its history, oldest first
+int sendRoom(int fd, struct room * room, char * data)
+{
+	struct history * history = room->history;
+	int len = MAX_ROOM_NAME + 1;
+	int i;
+
+	memcpy(data, room->name, MAX_ROOM_NAME + 1);
+	for (i = 0; i < history->count; i++)
+	{
+		int slot = (history->head + i) % HISTORY_LENGTH;
+		int start = history->start[slot];
+		int first = (history->length[slot] < HISTORY_SIZE - start) ? history->length[slot] : HISTORY_SIZE - start;
+		memcpy(data + len, history->data + start, first);
+		memcpy(data + len + first, history->data, history->length[slot] - first);
+		len += history->length[slot];
+	}
+	return sendRecord(fd, HANDOFF_ROOM, data, len, -1);
+}
+
+// sends the client's socket and state, then the bytes it sent that were not handled yet and the bytes queued
+// for it; returns -1 on failure
+int sendClient(int fd, struct clientData * client_info)
+{
+	struct handoffClient state;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	state.client_id = client_info->client_id;
+	state.state = client_info->state;
+	state.client_addr = client_info->client_addr;
+	state.read_len = client_info->read_len;
+	state.out_len = client_info->out_bytes - client_info->out_offset;
+	strcpy(state.username, client_info->username);
+	if (client_info->room != NULL)
+		strcpy(state.room, client_info->room->name);
+	if (sendRecord(fd, HANDOFF_CLIENT, &state, sizeof(state), client_info->client_fd) == -1 ||
+		sendData(fd, client_info->read_buffer, client_info->read_len) == -1)
+		return -1;
+	for (i = 0; i < client_info->out_count; i++)
+	{
+		struct sharedMessage * message = client_info->out_queue[(client_info->out_head + i) % client_info->out_size];
+		int offset = (i == 0) ? client_info->out_offset : 0;
+		if (sendData(fd, message->data + offset, message->len - offset) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// sends the listeners, room histories and clients of all shards to the new server; returns the amount of
+// clients sent, -1 on failure
+int sendState(int fd)
+{
+	char * data = malloc(HANDOFF_RECORD_SIZE);
+	struct room * room;
+	int clients = 0;
+	int i, j;
+
+	if (data == NULL)
+		return -1;
+	for (i = 0; i < shard_count; i++)
+	{
+		if (sendRecord(fd, HANDOFF_LISTENER, NULL, 0, shards[i].sock_fd) == -1)
+			clients = -1;
+	}
+
+	// every shard keeps the history of every room within its room limit, so shard 0's are sent
+	for (i = 0; i < ROOM_TABLE_SIZE && clients != -1; i++)
+	{
+		for (room = shards[0].rooms[i]; room != NULL && clients != -1; room = room->next)
+		{
+			if (room->history != NULL && room->history->count > 0 && sendRoom(fd, room, data) == -1)
+				clients = -1;
+		}
+	}
+
+	// clients that are disconnecting get what the socket takes and are closed when the server exits, like peer
+	// links, which the new server opens again
+	for (i = 0; i < shard_count && clients != -1; i++)
+	{
+		for (j = 0; j < shards[i].client_count && clients != -1; j++)
+		{
+			struct clientData * client_info = shards[i].client_list[j];
+			if (client_info->closing || client_info->state == CLIENT_PEER)
+				flushClient(client_info);
+			else if (sendClient(fd, client_info) == -1)
+				clients = -1;
+			else
+				clients++;
+		}
+	}
+	free(data);
+	return clients;
+}
+
+// hands the listeners and clients over to the new server connected to the upgrade socket and exits; returns
+// only if the new server did not take them, so the server shuts down as usual. Called once every event loop
+// has stopped. Sockets pass with SCM_RIGHTS, so clients stay connected and the listeners never close.
+void handOver(int fd)
+{
+	int next_id = atomic_load(&next_client_id);
+	char ack;
+	int i;
+
+	// messages posted between shards while they stopped go over in their recipients' queues; the journal is
+	// closed before the new server appends to it
+	for (i = 0; i < shard_count; i++)
+		drainInbox(&shards[i]);
+	int clients = sendState(fd);
+	stopJournal();
+	if (clients == -1 || sendRecord(fd, HANDOFF_END, &next_id, sizeof(next_id), -1) == -1 ||
+		recv(fd, &ack, 1, 0) != 1)
+	{
+		logMessage(LOG_ERROR, "[SERVER] ERROR: The new server did not take over, shutting down.\n");
+		close(fd);
+		return;
+	}
+	logMessage(LOG_INFO, "[SERVER] Handed %d clients over to the new server.\n", clients);
+	stopLogger();
+	exit(0);
+}
+
+// adds a client received from the old server to the specified shard, with its buffers; returns -1 on failure
+int adoptClient(int fd, struct shard * shard, struct handoffClient * state, int client_fd, char * data)
+{
+	struct clientData * client_info = openConnection(shard, client_fd);
+	if (client_info == NULL)
+		return -1;
+	client_info->client_id = state->client_id;
+	client_info->client_addr = state->client_addr;
+	client_info->server_addr = server_addr;
+	if (receiveBytes(fd, client_info, NULL, state->read_len, data) == -1 || watchClient(client_info) == -1)
+		return -1;
+
+	// the unsent bytes may start in the middle of a frame, so they are queued as one message
+	if (state->out_len > 0)
+	{
+		struct sharedMessage * message = malloc(sizeof(struct sharedMessage) + state->out_len);
+		if (message == NULL)
+			return -1;
+		atomic_init(&message->refs, 1);
+		message->len = state->out_len;
+		message->created = now();
+		if (receiveBytes(fd, NULL, message->data, state->out_len, data) == -1)
+		{
+			free(message);
+			return -1;
+		}
+		sendMessage(client_info, message);
+		releaseMessage(message);
+	}
+
+	// a client still in the handshake gets a new deadline
+	if (state->state != CLIENT_ACTIVE || !validRoomName(state->room))
+	{
+		startHandshake(client_info);
+		return 0;
+	}
+	client_info->state = CLIENT_ACTIVE;
+	strcpy(client_info->username, state->username);
+	enterRoom(client_info, state->room);
+	recordChange(shard, 0, client_info);
+	return 0;
+}
+
+// adds the frames of a room received from the old server to shard 0's history of the room
+void adoptRoom(char * data, int len)
+{
+	int pos = MAX_ROOM_NAME + 1;
+	if (len < pos || memchr(data, '\0', MAX_ROOM_NAME + 1) == NULL || !validRoomName(data))
+		return;
+	struct room * room = openRoom(&shards[0], data);
+	while (room != NULL && len - pos >= FRAME_HEADER_SIZE)
+	{
+		int frame_len = FRAME_HEADER_SIZE + decodeFrameLength((unsigned char *)data + pos);
+		if (frame_len > len - pos)
+			break;
+		recordHistory(room, data + pos, frame_len);
+		pos += frame_len;
+	}
+}
+
+// takes the listeners, room histories and clients over from the old server connected to fd and opens the shards
+// with its listeners; exits on failure
+void takeOver(int fd)
+{
+	int listeners[MAX_SHARDS];
+	int listener_count = 0;
+	int clients = 0;
+	int opened = 0;
+	int type, passed_fd, len;
+	char * data = malloc(HANDOFF_RECORD_SIZE);
+
+	if (data == NULL)
+		error("[SERVER] ERROR: Out of memory.\n");
+	for (;;)
+	{
+		if ((len = receiveRecord(fd, &type, data, &passed_fd)) == -1)
+			error("[SERVER] ERROR: Failed to take over from the old server.\n");
+		if (type == HANDOFF_LISTENER && !opened && passed_fd != -1 && listener_count < MAX_SHARDS)
+		{
+			listeners[listener_count++] = passed_fd;
+			continue;
+		}
+
+		// the listeners come first; once they are in, the shards can be opened
+		if (!opened)
+		{
+			openShards(listeners, listener_count);
+			opened = 1;
+		}
+		if (type == HANDOFF_ROOM)
+			adoptRoom(data, len);
+		else if (type == HANDOFF_CLIENT && passed_fd != -1 && len == sizeof(struct handoffClient))
+		{
+			if (adoptClient(fd, &shards[clients % shard_count], (struct handoffClient *)data, passed_fd, data) == -1)
+				error("[SERVER] ERROR: Failed to take over a client from the old server.\n");
+			clients++;
+		}
+		else if (type == HANDOFF_END && len == sizeof(int))
+		{
+			memcpy(&len, data, sizeof(int));
+			atomic_store(&next_client_id, len);
+			break;
+		}
+		else
+			error("[SERVER] ERROR: Unexpected data from the old server.\n");
+	}
+	copyHistories();
+	free(data);
+
+	// the old server exits once it knows its clients are taken
+	if (write(fd, "", 1) != 1)
+		error("[SERVER] ERROR: Failed to take over from the old server.\n");
+	close(fd);
+	logMessage(LOG_INFO, "[SERVER] Took %d clients over from the old server.\n", clients);
+}
+
+// connects to a running server's upgrade socket at the specified path; returns -1 if no server listens there
+int connectUpgrade(const char * path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// listens for the next upgrade on a Unix socket at the specified path, replacing whatever is there; exits on
+// failure
+int listenUpgrade(const char * path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1)
+		error("[SERVER] ERROR: Failed to listen on upgrade socket.\n");
+	return fd;
+}
+
+// upgrade thread: waits for a new server to connect to the upgrade socket, then stops the event loops so the
+// main thread hands everything over
+void * runUpgrade(void * arg)
+{
+	int listen_fd = (int)(intptr_t)arg;
+	uint64_t one = 1;
+	for (;;)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			logMessage(LOG_ERROR, "[SERVER] ERROR: Accept on upgrade socket failed.\n");
+			return NULL;
+		}
+
+		// a server already shutting down has nothing to hand over
+		if (shutdown_requested)
+		{
+			close(fd);
+			return NULL;
+		}
+		logMessage(LOG_INFO, "[SERVER] A new server is taking over...\n");
+		upgrade_fd = fd;
+		atomic_store(&upgrading, 1);
+		shutdown_requested = 1;
+		write(shards[0].event_fd, &one, sizeof(one));
+		return NULL;
+	}
+}
+
+// sends the shutdown message to all connected clients, waits 10 seconds, then closes all sockets;
+// called once every event loop has stopped
+void shutdownServer()
+{
+	unsigned long long total_dropped = 0;					/* messages dropped from all full queues */
+	unsigned long long total_slow_disconnects = 0;			/* clients disconnected because their queue was full */
+	int i, j;
+
+	// send message to all connected clients that server is about to shut down
+	printf("[SERVER] Server will shut down in 10 seconds...\n");
+	for (i = 0; i < shard_count; i++)
+	{
+		drainInbox(&shards[i]);
+		for (j = 0; j < shards[i].client_count; j++)
+			sendFrame(shards[i].client_list[j], FRAME_SERVER_KILL, NULL, 0);
+		flushPending(&shards[i]);
+	}
+
+	// wait 10 seconds
+	sleep(10);
+
+	// send what is left, close sockets, exit program
+	for (i = 0; i < shard_count; i++)
+	{
+		struct shard * shard = &shards[i];
+		total_dropped += counterGet(&shard->stats.dropped);
+		total_slow_disconnects += counterGet(&shard->stats.slow_disconnects);
+		close(shard->sock_fd);
+		while (shard->client_count > 0)
+		{
+			flushClient(shard->client_list[0]);
+			closeConnection(shard->client_list[0]);
+		}
+	}
+	stopJournal();
+	logMessage(LOG_INFO, "[SERVER] %llu messages dropped, %llu slow clients disconnected.\n", total_dropped,
+			   total_slow_disconnects);
+
+	if (upgrade_path != NULL)
+		unlink(upgrade_path);
+
+	// write what is left in the log before exiting
+	stopLogger();
+	if (logDropped() > 0)
+		fprintf(stderr, "[SERVER] %llu log lines dropped.\n", logDropped());
+	exit(0);
+}
+
+// resolves a peer server given as host:port; returns -1 if it can not be resolved
+int parsePeer(struct peerServer * peer, const char * name)
+{
+	struct addrinfo hints, * result;
+	char host[64];
+	const char * port = strrchr(name, ':');
+	if (port == NULL || port - name >= (int)sizeof(host) || strlen(name) >= sizeof(peer->name))
+		return -1;
+	memcpy(host, name, port - name);
+	host[port - name] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port + 1, &hints, &result) != 0)
+		return -1;
+	memset(peer, 0, sizeof(struct peerServer));
+	memcpy(&peer->addr, result->ai_addr, sizeof(peer->addr));
+	strcpy(peer->name, name);
+	freeaddrinfo(result);
+	return 0;
+}
+
+// server main thread
+int main(int argc, char ** argv)
+{
+	// set signal handlers; a client closing its socket must not kill the server
+	signal(SIGINT, sigHandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	// seed random
+	srand(time(NULL));
+
+	int port_no;											/* port number */
+	char hostname[100];										/* server hostname */
+	struct hostent * h;										/* serve hostent */
+	int i;													/* loop iterator variable */
+	int option;												/* current command line option */
+	sigset_t sigint_mask;									/* SIGINT, blocked in worker threads */
+	pthread_t upgrade_thread;								/* thread waiting for an upgrade */
+	int old_fd = -1;										/* connection to the server being upgraded */
+	int upgrade_listen_fd = -1;								/* Unix socket listening for the next upgrade */
+	long kb_rate;											/* KB per second given with -k */
+	char * end;												/* end of the number parsed from an option */
+
+	// read options
+	while ((option = getopt(argc, argv, "q:b:p:t:r:w:um:k:f:l:j:x:F:P:")) != -1)
+	{
+		switch (option)
+		{
+			case 'q':
+				if ((max_queue_messages = atoi(optarg)) < 2)
+					error("[SERVER] ERROR: Queue length must be at least 2 messages.\n");
+				break;
+			case 'b':
+				if ((max_queue_bytes = atoi(optarg)) < MAX_BUFFER_SIZE)
+					error("[SERVER] ERROR: Queue size must be at least 512 bytes.\n");
+				break;
+			case 'p':
+				if (strcmp(optarg, "drop") == 0)
+					queue_policy = POLICY_DROP_OLDEST;
+				else if (strcmp(optarg, "disconnect") == 0)
+					queue_policy = POLICY_DISCONNECT;
+				else
+					error("[SERVER] ERROR: Invalid queue policy. Use 'drop' or 'disconnect'.\n");
+				break;
+			case 't':
+				if ((shard_count = atoi(optarg)) < 1 || shard_count > MAX_SHARDS)
+					error("[SERVER] ERROR: Thread count must be between 1 and 64.\n");
+				break;
+			case 'r':
+				if ((replay_length = atoi(optarg)) < 0)
+					error("[SERVER] ERROR: Replay length must not be negative.\n");
+				break;
+			case 'w':
+				if ((handshake_timeout = atoi(optarg)) < 1)
+					error("[SERVER] ERROR: Handshake timeout must be at least 1 second.\n");
+				break;
+			case 'u':
+				use_uring = 1;
+				break;
+			case 'm':
+				if ((message_rate = atoi(optarg)) < 0)
+					error("[SERVER] ERROR: Message rate must not be negative.\n");
+				break;
+			case 'k':
+				// parsed as a long so that a rate too large for byte_rate is caught before it is scaled
+				kb_rate = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || kb_rate < 0 || kb_rate > INT_MAX / 1000)
+					error("[SERVER] ERROR: Byte rate must be between 0 and 2147483 KB per second.\n");
+				byte_rate = (int)kb_rate * 1000;
+				break;
+			case 'f':
+				if ((flood_limit = atoi(optarg)) < 0)
+					error("[SERVER] ERROR: Flood limit must not be negative.\n");
+				break;
+			case 'l':
+				if (strcmp(optarg, "error") == 0)
+					log_level = LOG_ERROR;
+				else if (strcmp(optarg, "warn") == 0)
+					log_level = LOG_WARN;
+				else if (strcmp(optarg, "info") == 0)
+					log_level = LOG_INFO;
+				else if (strcmp(optarg, "chat") == 0)
+					log_level = LOG_CHAT;
+				else
+					error("[SERVER] ERROR: Invalid log level. Use 'error', 'warn', 'info' or 'chat'.\n");
+				break;
+			case 'j':
+				journal_path = optarg;
+				break;
+			case 'x':
+				if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+					error("[SERVER] ERROR: Upgrade socket path is too long.\n");
+				upgrade_path = optarg;
+				break;
+			case 'F':
+				federation_key = optarg;
+				break;
+			case 'P':
+				if (peer_server_count == MAX_PEERS)
+					error("[SERVER] ERROR: Too many peer servers.\n");
+				if (parsePeer(&peer_servers[peer_server_count], optarg) == -1)
+					error("[SERVER] ERROR: Invalid peer server. Use -P <host:port>.\n");
+				peer_server_count++;
+				break;
+			default:
+				error("[SERVER] ERROR: Invalid option. Usage is 'server [-q n] [-b n] [-p drop|disconnect] [-t n] [-r n] [-w s] "
+					  "[-u] [-m n] [-k n] [-f n] [-l level] [-j file] [-x path] [-F key] [-P host:port] <port number>'.\n");
+		}
+	}
+
+	// check for validity of arguments
+	if (argc - optind != 1)
+		error("[SERVER] ERROR: Incorrect number of arguments. Usage is 'server [options] <port number>'.\n");
+	else if ((port_no = atoi(argv[optind])) <= 0)
+		error("[SERVER] ERROR: Invalid port number specified. Please specify a nonzero port number.\n");
+	else if (peer_server_count > 0 && federation_key == NULL)
+		error("[SERVER] ERROR: Peer servers need a federation key (-F).\n");
+
+	// a new ID for every run, so peer servers never mistake new messages for copies of old ones
+	if (getrandom(&server_id, sizeof(server_id), 0) != sizeof(server_id))
+		server_id = ((uint64_t)getpid() << 32) ^ now();
+
+	// set values for server_addr struct
+	server_addr.sin_family = AF_INET;						/* Internet addresses */
+	server_addr.sin_port = htons(port_no);					/* port number */
+	server_addr.sin_addr.s_addr = INADDR_ANY;				/* IP address of machine running server */
+
+	// start the logger before any event loop can log, with SIGINT blocked like the worker shards
+	sigemptyset(&sigint_mask);
+	sigaddset(&sigint_mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL);
+	if (startLogger(STDERR_FILENO, log_level) == -1)
+		error("[SERVER] ERROR: Failed to start logger.\n");
+	pthread_sigmask(SIG_UNBLOCK, &sigint_mask, NULL);
+
+	// create an event loop per shard, listening on the sockets of the server being upgraded if there is one
+	start_time = now();
+	initCommands();
+	if (upgrade_path != NULL)
+		old_fd = connectUpgrade(upgrade_path);
+	if (old_fd != -1)
+		takeOver(old_fd);
+	else
+		openShards(NULL, 0);
+	if (journal_path != NULL)
+		openJournal(journal_path, old_fd == -1);
+	if (upgrade_path != NULL)
+		upgrade_listen_fd = listenUpgrade(upgrade_path);
+
+	// server started successfully, print server IP address
+	gethostname(hostname, sizeof(hostname));
+	h = gethostbyname(hostname);
+	printf("Server started successfully. [%s]\n", h ? h->h_name : hostname);
+	printf("Server is listening for clients...\n");
+
+	// start worker shards with SIGINT blocked, so the signal always interrupts the main thread's shard
+	pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL);
+	startJournal();
+	for (i = 1; i < shard_count; i++)
+	{
+		if (pthread_create(&shards[i].thread, NULL, runShard, &shards[i]) != 0)
+			error("[SERVER] ERROR: Failed to create thread.\n");
+	}
+	if (upgrade_listen_fd != -1)
+	{
+		if (pthread_create(&upgrade_thread, NULL, runUpgrade, (void *)(intptr_t)upgrade_listen_fd) != 0)
+			error("[SERVER] ERROR: Failed to create thread.\n");
+		pthread_detach(upgrade_thread);
+	}
+	pthread_sigmask(SIG_UNBLOCK, &sigint_mask, NULL);
+
+	// run shard 0 on the main thread, then wait for the others to stop
+	runShard(&shards[0]);
+	for (i = 1; i < shard_count; i++)
+		pthread_join(shards[i].thread, NULL);
+
+	if (upgrading)
+		handOver(upgrade_fd);
+	shutdownServer();
+	return 0;
 }
\ No newline at end of file
@@ -9,18 +9,53 @@
 *   (outFile) at the end of the program.            *
 *                                                   *
 *	To compile and run:								*
-*	mpicc main.c -o hw2                             *
-*	hw2 <total> <inFile> <outFile>                  *
+*	mpicc -pthread main.c -o hw2                    *
+*	hw2 <total> <inFile> <outFile> [options]        *
 *   (NOTE: outFile is optional)                     *
+*                                                   *
+*   Options:                                        *
+*   --checkpoint <dir>  checkpoint every round      *
+*   --restart           resume from <dir>           *
+*   --pin               pin ranks to local memory   *
+*   --stream <src>      serve batches and queries   *
+*                       from src ("-" for stdin)    *
 ****************************************************/
 
 #define LOW 0
 #define HIGH 1
+#define COUNT_SORT_MAX_RANGE 65536      // largest key range (max - min + 1) sorted with counting sort
+#define CHECKPOINT_SLOTS 3              // checkpoint files kept per process (rounds may differ by 2 between processes)
+#define CHECKPOINT_MAGIC 0x42534B31     // marks a complete checkpoint file
+#define CHECKPOINT_PATH_SIZE 4096       // max length of checkpoint file path
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // smallest buffer worth backing with huge pages
+#define PLACEMENT_LINE_SIZE 160         // max length of a process's placement report
+#define STREAM_TIER_BASE 1024           // largest run in the smallest size tier of the streaming service
+#define STREAM_TIER_FANOUT 4            // runs of one tier merged together by the streaming service
+#define MPOL_F_NODE (1 << 0)            // get_mempolicy flag: return node instead of policy
+#define MPOL_F_ADDR (1 << 1)            // get_mempolicy flag: look up policy of an address
+
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <mpi.h>
 #include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// command line options (removed from argv before the positional arguments are read)
+char * checkpointDir = NULL;    // directory for per-round checkpoints of each process's block
+int restart = 0;                // resume from the last round completed in checkpointDir
+int pinRanks = 0;               // pin processes to cpus and place their buffers on the local NUMA node
+char * streamSource = NULL;     // input of the streaming sort service (runs instead of a single sort)
 
 // sends/receives broadcast from master and closes program if error flag buffer is set
 void check_error(int * error)
@@ -39,218 +74,977 @@ void check_error(int * error)
     }
 }
 
-// sorts the specified array using radix sort algorithm
-void local_sort(int * nums, int total)
+// reads options from the command line and removes them from argv, leaving only positional arguments
+void parse_options(int * argc, char ** argv)
+{
+    int i;              // for loop iterator
+    int n = 1;          // amount of arguments kept in argv
+    
+    for (i = 1; i < *argc; i++)
+    {
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < *argc)
+        {
+            checkpointDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--restart") == 0)
+        {
+            restart = 1;
+        }
+        else if (strcmp(argv[i], "--pin") == 0)
+        {
+            pinRanks = 1;
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < *argc)
+        {
+            streamSource = argv[++i];
+        }
+        else
+        {
+            argv[n++] = argv[i];
+        }
+    }
+    
+    *argc = n;
+}
+
+//////////////////////////////
+//                          //
+//  SORT KERNELS            //
+//                          //
+//////////////////////////////
+
+// key extractor: maps an int to an unsigned key whose natural order is the sort order
+#define KEY_INT32(x)        ((uint32_t)(x) ^ 0x80000000u)
+
+// generates the local kernels for one element type and ordering:
+//   local_sort_<name>(nums, total)                         sorts nums with a byte-wise LSD radix sort
+//   merge_<name>(left, nl, right, nr, merged)              merges two sorted arrays into merged
+//   bitonic_swap_<name>(start, gap, spread, nums, mode)    merges two sorted swap sections, keeping the
+//                                                          lowest elements on the left (LOW) or right (HIGH)
+// key(x) must return a key_type (uint32_t or uint64_t) ordered like the elements, so every comparison
+// is expanded inline at compile time instead of going through a comparator function pointer
+#define DEFINE_SORT_KERNELS(name, type, key_type, key)                                                  \
+void local_sort_##name(type * nums, int total)                                                          \
+{                                                                                                       \
+    int i;                                                  /* for loop iterator */                     \
+    unsigned int shift;                                     /* bit offset of current radix digit */     \
+    type * radix = (type *)malloc(total * sizeof(type));    /* radix array */                           \
+    type * swap;                                            /* temporary pointer for swapping arrays */ \
+    type * src = nums;                                      /* array sorted by previous digits */       \
+                                                                                                        \
+    /* sort by each byte of the key, starting from the least significant byte */                        \
+    for (shift = 0; shift < 8 * sizeof(key_type); shift += 8)                                           \
+    {                                                                                                   \
+        int bucket[257] = { 0 };                                                                        \
+                                                                                                        \
+        /* store count of digits of all elements for current byte */                                    \
+        for (i = 0; i < total; i++)                                                                     \
+        {                                                                                               \
+            bucket[((key(src[i]) >> shift) & 0xFF) + 1]++;                                              \
+        }                                                                                               \
+                                                                                                        \
+        /* skip this byte if every element shares the same digit */                                     \
+        if (total == 0 || bucket[((key(src[0]) >> shift) & 0xFF) + 1] == total)                         \
+        {                                                                                               \
+            continue;                                                                                   \
+        }                                                                                               \
+                                                                                                        \
+        /* turn counts into starting offsets of each bucket */                                          \
+        for (i = 1; i < 257; i++)                                                                       \
+        {                                                                                               \
+            bucket[i] += bucket[i - 1];                                                                 \
+        }                                                                                               \
+                                                                                                        \
+        /* insert elements into the other array, stable by current digit */                            \
+        for (i = 0; i < total; i++)                                                                     \
+        {                                                                                               \
+            radix[bucket[(key(src[i]) >> shift) & 0xFF]++] = src[i];                                    \
+        }                                                                                               \
+                                                                                                        \
+        /* swap arrays instead of copying back */                                                       \
+        swap = src;                                                                                     \
+        src = radix;                                                                                    \
+        radix = swap;                                                                                   \
+    }                                                                                                   \
+                                                                                                        \
+    /* copy result into nums if the last pass ended in the radix array */                               \
+    if (src != nums)                                                                                    \
+    {                                                                                                   \
+        memcpy(nums, src, total * sizeof(type));                                                        \
+        radix = src;                                                                                    \
+    }                                                                                                   \
+                                                                                                        \
+    free(radix);                                                                                        \
+}                                                                                                       \
+                                                                                                        \
+void merge_##name(type * left, int nl, type * right, int nr, type * merged)                           \
+{                                                                                                       \
+    int i = 0;                                              /* index of left array */                   \
+    int j = 0;                                              /* index of right array */                  \
+    int n = 0;                                              /* index of merged array */                 \
+                                                                                                        \
+    /* merge both sorted arrays, taking from the left array on ties to keep the merge stable */         \
+    while (i < nl && j < nr)                                                                            \
+    {                                                                                                   \
+        if (key(left[i]) > key(right[j]))                                                               \
+            merged[n++] = right[j++];                                                                   \
+        else                                                                                            \
+            merged[n++] = left[i++];                                                                    \
+    }                                                                                                   \
+    while (i < nl)                                                                                      \
+        merged[n++] = left[i++];                                                                        \
+    while (j < nr)                                                                                      \
+        merged[n++] = right[j++];                                                                       \
+}                                                                                                       \
+                                                                                                        \
+void bitonic_swap_##name(int start, int gap, int spread, type * nums, int mode)                         \
+{                                                                                                       \
+    type * merged = (type *)malloc(2 * spread * sizeof(type)); /* both sections merged in order */      \
+                                                                                                        \
+    /* merge both sorted swap sections */                                                               \
+    merge_##name(&nums[start], spread, &nums[start + gap], spread, merged);                             \
+                                                                                                        \
+    /* place the lowest elements in the left section for a low swap, in the right one for a high swap */\
+    if (mode == LOW)                                                                                    \
+    {                                                                                                   \
+        memcpy(&nums[start], merged, spread * sizeof(type));                                            \
+        memcpy(&nums[start + gap], &merged[spread], spread * sizeof(type));                             \
+    }                                                                                                   \
+    else if (mode == HIGH)                                                                              \
+    {                                                                                                   \
+        memcpy(&nums[start + gap], merged, spread * sizeof(type));                                      \
+        memcpy(&nums[start], &merged[spread], spread * sizeof(type));                                   \
+    }                                                                                                   \
+                                                                                                        \
+    free(merged);                                                                                       \
+}
+
+// kernels for the int lists the sort works on
+DEFINE_SORT_KERNELS(int, int, uint32_t, KEY_INT32)
+
+// sorts a low-cardinality list by reducing per-process key histograms and materializing each process's block from the counts
+void count_sort(int * nums, int myTotal, int progid, int dummyNums, int dummy, int * keyRange)
+{
+    // counting sort variables
+    int i;                                                  // for loop iterator
+    int key = 0;                                            // current key offset (key - keyRange[0])
+    int * counts = (int *)calloc(keyRange[1], sizeof(int)); // histogram of keys in the whole list
+    int start = progid * myTotal;                           // index of this process's first number in the whole list
+    int skip;                                               // amount of real numbers stored before this process's block
+
+    // count keys in this process's block, excluding the dummy numbers at the front of the list
+    for (i = 0; i < myTotal; i++)
+    {
+        if (start + i >= dummyNums)
+        {
+            counts[nums[i] - keyRange[0]]++;
+        }
+    }
+
+    // sum histograms of all processes so every process knows the global key counts
+    MPI_Allreduce(MPI_IN_PLACE, counts, keyRange[1], MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    // fill any dummy positions of this process's block
+    for (i = 0; i < myTotal && start + i < dummyNums; i++)
+    {
+        nums[i] = dummy;
+    }
+
+    // skip keys belonging to blocks of lower ranked processes
+    skip = (start > dummyNums) ? start - dummyNums : 0;
+    while (key < keyRange[1] && skip >= counts[key])
+    {
+        skip -= counts[key];
+        key++;
+    }
+    counts[key] -= skip;
+
+    // materialize the rest of this process's block from the key counts
+    for (; i < myTotal; i++)
+    {
+        while (counts[key] == 0)
+        {
+            key++;
+        }
+        nums[i] = key + keyRange[0];
+        counts[key]--;
+    }
+
+    // free memory allocated to counts
+    free(counts);
+}
+
+
+//////////////////////////////
+//                          //
+//  CHECKPOINTING           //
+//                          //
+//////////////////////////////
+
+// header stored in front of each process's checkpointed block
+struct checkpoint_header
+{
+    int magic;              // CHECKPOINT_MAGIC, identifies a complete checkpoint file
+    int round;              // index of the completed gap iteration
+    int gap;                // gap of the completed gap iteration
+    int total;              // amount of numbers in the whole list (including dummies)
+    int dummyNums;          // amount of dummy numbers in the whole list
+    int numprocs;           // number of processes that wrote the checkpoint
+    int count;              // amount of numbers in this process's block
+    unsigned int checksum;  // checksum of the input list, so checkpoints of other runs are never loaded
+};
+
+// state of this process's background checkpoint writer
+struct checkpoint_writer
+{
+    pthread_t thread;                   // thread writing the current checkpoint
+    int active;                         // true if thread has not been joined yet
+    int progid;                         // rank of this process
+    struct checkpoint_header header;    // header of the checkpoint being written
+    int * nums;                         // copy of this process's block being written
+};
+
+// returns the FNV-1a checksum of the specified numbers
+unsigned int checkpoint_checksum(int * nums, int count)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+    
+    for (i = 0; i < count; i++)
+    {
+        hash = (hash ^ (unsigned int)nums[i]) * 16777619u;
+    }
+    
+    return hash;
+}
+
+// builds the path of the checkpoint file for the specified rank and slot
+void checkpoint_path(char * path, int progid, int slot, const char * suffix)
+{
+    snprintf(path, CHECKPOINT_PATH_SIZE, "%s/ckpt.%d.%d%s", checkpointDir, progid, slot, suffix);
+}
+
+// function used by writer thread to write a checkpoint to a temporary file and rename it into place
+void * checkpoint_write(void * arg)
+{
+    struct checkpoint_writer * writer = (struct checkpoint_writer *)arg;
+    char tmpPath[CHECKPOINT_PATH_SIZE];     // path of temporary checkpoint file
+    char path[CHECKPOINT_PATH_SIZE];        // path of checkpoint file
+    int slot = writer->header.round % CHECKPOINT_SLOTS;
+    FILE * file;
+    
+    checkpoint_path(tmpPath, writer->progid, slot, ".tmp");
+    checkpoint_path(path, writer->progid, slot, "");
+    
+    // write header and block; a failed write only loses this checkpoint, not the sort
+    file = fopen(tmpPath, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to write checkpoint (%s).\n", tmpPath);
+        return NULL;
+    }
+    if (fwrite(&writer->header, sizeof(writer->header), 1, file) != 1 ||
+        fwrite(writer->nums, sizeof(int), writer->header.count, file) != (size_t)writer->header.count ||
+        fflush(file) != 0 || fsync(fileno(file)) != 0)
+    {
+        fprintf(stderr, "Failed to write checkpoint (%s).\n", tmpPath);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    
+    // replace the old checkpoint in this slot only once the new one is complete
+    if (rename(tmpPath, path) != 0)
+    {
+        fprintf(stderr, "Failed to write checkpoint (%s).\n", path);
+    }
+    
+    return NULL;
+}
+
+// waits for the checkpoint currently being written by this process to finish
+void checkpoint_wait(struct checkpoint_writer * writer)
+{
+    if (writer->active)
+    {
+        pthread_join(writer->thread, NULL);
+        writer->active = 0;
+    }
+}
+
+// copies this process's block and starts writing it as the checkpoint of the specified round
+void checkpoint_round(struct checkpoint_writer * writer, int round, int gap, int total, int dummyNums,
+                      int numprocs, unsigned int checksum, int * nums, int count)
+{
+    // wait for previous checkpoint so at most one write is in flight
+    checkpoint_wait(writer);
+    
+    // copy block so the exchange can keep modifying nums while the copy is written
+    if (!writer->nums)
+    {
+        writer->nums = (int *)malloc(count * sizeof(int));
+    }
+    memcpy(writer->nums, nums, count * sizeof(int));
+    
+    // set checkpoint header
+    writer->header.magic = CHECKPOINT_MAGIC;
+    writer->header.round = round;
+    writer->header.gap = gap;
+    writer->header.total = total;
+    writer->header.dummyNums = dummyNums;
+    writer->header.numprocs = numprocs;
+    writer->header.count = count;
+    writer->header.checksum = checksum;
+    
+    // write checkpoint in the background
+    if (pthread_create(&writer->thread, NULL, &checkpoint_write, writer) == 0)
+    {
+        writer->active = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Checkpoint thread create failed, round %d not checkpointed.\n", round);
+    }
+}
+
+// reads the checkpoint in the specified slot if it belongs to the run described by the total, dummyNums, numprocs,
+// count and checksum of run; returns its round, or -1 if the slot has no valid checkpoint of this run
+int checkpoint_read(int progid, int slot, struct checkpoint_header * run, struct checkpoint_header * header, int * nums)
+{
+    char path[CHECKPOINT_PATH_SIZE];    // path of checkpoint file
+    FILE * file;
+    int round = -1;
+    
+    checkpoint_path(path, progid, slot, "");
+    file = fopen(path, "rb");
+    if (!file)
+    {
+        return -1;
+    }
+    
+    // read header, then block if a destination is specified; a checkpoint of another run is rejected before its
+    // block is read, so a larger block can never overrun nums
+    if (fread(header, sizeof(*header), 1, file) == 1 && header->magic == CHECKPOINT_MAGIC &&
+        header->total == run->total && header->dummyNums == run->dummyNums && header->numprocs == run->numprocs &&
+        header->count == run->count && header->checksum == run->checksum &&
+        (!nums || fread(nums, sizeof(int), header->count, file) == (size_t)header->count))
+    {
+        round = header->round;
+    }
+    fclose(file);
+    
+    return round;
+}
+
+// finds the last round checkpointed by every process and loads this process's block of it;
+// returns that round's gap and stores the round in restored, or returns -1 if there is no usable checkpoint
+int checkpoint_restart(int progid, int numprocs, int total, int dummyNums, unsigned int checksum, int * nums,
+                       int count, int * restored)
 {
-    // radix sort variables
-    int i;                    // for loop iterator
-    int * radix;              // radix array
-    int max = 0;              // maximum value in nums array
-    int exp = 1;              // exponent value
+    struct checkpoint_header run = { 0 };   // identity of this run, which a usable checkpoint must match
+    struct checkpoint_header header;    // header of current checkpoint file
+    int slot;                           // current checkpoint slot
+    int round = -1;                     // latest round checkpointed by this process
+    int gap = -1;                       // gap of the restored round
+    int failed;                         // true if any process failed to restore the round
     
-    // initialize radix array and set contents to 0
-    radix = (int *)malloc(total * sizeof(int));
+    run.total = total;
+    run.dummyNums = dummyNums;
+    run.numprocs = numprocs;
+    run.count = count;
+    run.checksum = checksum;
     
-    // find maximum value in nums array
-    for (i = 0; i < total; i++)
+    // find latest round checkpointed by this process in this run; leftovers of other runs are skipped
+    for (slot = 0; slot < CHECKPOINT_SLOTS; slot++)
     {
-        if (nums[i] > max)
-            max = nums[i];
+        int slotRound = checkpoint_read(progid, slot, &run, &header, NULL);
+        if (slotRound > round)
+            round = slotRound;
     }
     
-    // loop until current radix exceeds max
-    while (max / exp > 0)
+    // the last round completed everywhere is the earliest of the latest rounds of all processes
+    MPI_Allreduce(MPI_IN_PLACE, &round, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (round < 0)
+    {
+        return -1;
+    }
+    
+    // load this process's block of that round
+    if (checkpoint_read(progid, round % CHECKPOINT_SLOTS, &run, &header, nums) == round)
+    {
+        gap = header.gap;
+    }
+    
+    // make sure every process restored the same round
+    failed = (gap < 0);
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed)
+    {
+        return -1;
+    }
+    
+    if (progid == 0)
+    {
+        fprintf(stdout, "Restarting from checkpoint of round %d (gap = %d).\n", round, gap);
+    }
+    
+    *restored = round;
+    return gap;
+}
+
+//////////////////////////////
+//                          //
+//  NUMA PLACEMENT          //
+//                          //
+//////////////////////////////
+
+// returns the NUMA node of the specified cpu, or -1 if the system does not report one
+int cpu_node(int cpu)
+{
+    char path[64];              // sysfs directory of cpu
+    struct dirent * entry;      // current entry of cpu directory
+    int node = -1;
+    DIR * dir;
+    
+    // the cpu directory contains a node<N> link to the node it belongs to
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+    {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(&entry->d_name[4]);
+            break;
+        }
+    }
+    closedir(dir);
+    
+    return node;
+}
+
+// returns the NUMA node holding the page at the specified address, or -1 if it can not be determined
+int page_node(void * addr)
+{
+    int node = -1;
+    
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+    {
+        return -1;
+    }
+    
+    return node;
+}
+
+// pins this process (and threads it creates later) to one cpu, chosen by its rank among the processes on this host;
+// returns the cpu, or -1 if pinning failed
+int pin_process(MPI_Comm localComm)
+{
+    cpu_set_t allowed;          // cpus this process may run on
+    cpu_set_t pinned;           // the single cpu this process is pinned to
+    int localRank;              // rank of this process on this host
+    int cpu;                    // current cpu
+    int n = 0;                  // index of current allowed cpu
+    int target;                 // index of allowed cpu to pin to
+    
+    MPI_Comm_rank(localComm, &localRank);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+    {
+        return -1;
+    }
+    
+    // spread processes on this host over the allowed cpus in order
+    target = localRank % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && n++ == target)
+        {
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            return (sched_setaffinity(0, sizeof(pinned), &pinned) == 0) ? cpu : -1;
+        }
+    }
+    
+    return -1;
+}
+
+// allocates a buffer for this process's numbers; when pinned, the buffer is mapped with huge pages where available
+// and touched by this process so its pages are placed on the local NUMA node
+void * alloc_local(size_t bytes)
+{
+    void * buffer;
+    
+    if (!pinRanks)
+    {
+        return malloc(bytes);
+    }
+    
+    buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    // ask for transparent huge pages (ignored if unsupported), then first-touch every page from the pinned cpu
+    if (bytes >= HUGE_PAGE_SIZE)
+    {
+        madvise(buffer, bytes, MADV_HUGEPAGE);
+    }
+    memset(buffer, 0, bytes);
+    
+    return buffer;
+}
+
+// frees a buffer allocated by alloc_local
+void free_local(void * buffer, size_t bytes)
+{
+    if (!pinRanks)
+    {
+        free(buffer);
+    }
+    else if (buffer)
+    {
+        munmap(buffer, bytes);
+    }
+}
+
+// prints the cpu, NUMA node and buffer placement of every process (gathered to master)
+void report_placement(int progid, int numprocs, int cpu, void * buffer)
+{
+    char line[PLACEMENT_LINE_SIZE];         // placement of this process
+    char hostname[64];                      // hostname of this process
+    char * lines = NULL;                    // placement of all processes (master only)
+    int i;                                  // for loop iterator
+    
+    gethostname(hostname, sizeof(hostname));
+    hostname[sizeof(hostname) - 1] = '\0';
+    snprintf(line, sizeof(line), "Rank %d: host %s, cpu %d, NUMA node %d, buffer on node %d",
+             progid, hostname, cpu, (cpu >= 0) ? cpu_node(cpu) : -1, page_node(buffer));
+    
+    if (progid == 0)
+    {
+        lines = (char *)malloc(numprocs * PLACEMENT_LINE_SIZE);
+    }
+    MPI_Gather(line, PLACEMENT_LINE_SIZE, MPI_CHAR, lines, PLACEMENT_LINE_SIZE, MPI_CHAR, 0, MPI_COMM_WORLD);
+    
+    if (progid == 0)
+    {
+        for (i = 0; i < numprocs; i++)
+        {
+            fprintf(stdout, "%s\n", &lines[i * PLACEMENT_LINE_SIZE]);
+        }
+        free(lines);
+    }
+}
+
+//////////////////////////////
+//                          //
+//  STREAMING SORT SERVICE  //
+//                          //
+//////////////////////////////
+
+// sorted run of numbers; a run is never modified after it is added to the run set
+struct run
+{
+    int * nums;             // sorted numbers
+    int count;              // amount of numbers in run
+};
+
+// LSM-style set of sorted runs, compacted by size tier in the background
+struct run_set
+{
+    struct run ** runs;     // runs in the set, oldest first
+    int count;              // amount of runs in the set
+    int capacity;           // allocated length of runs
+    int merging;            // true while the compactor is merging runs outside the lock
+    int stop;               // true when the compactor should exit
+    pthread_mutex_t lock;   // protects all fields (runs themselves are immutable)
+    pthread_cond_t changed; // signaled when runs are added or the service stops
+};
+
+// returns the size tier of a run: runs within a factor of STREAM_TIER_FANOUT of each other share a tier
+int run_tier(int count)
+{
+    long long limit = STREAM_TIER_BASE;     // largest run in current tier
+    int tier = 0;
+    
+    while (count > limit)
+    {
+        limit *= STREAM_TIER_FANOUT;
+        tier++;
+    }
+    
+    return tier;
+}
+
+// returns the index of the first number in the sorted array that is >= x
+int lower_bound(int * nums, int count, int x)
+{
+    int low = 0;
+    int high = count;
+    
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (nums[mid] < x)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    
+    return low;
+}
+
+// returns the amount of numbers in all runs that are < x (or <= x if inclusive); caller holds the lock
+long long run_set_rank(struct run_set * set, int x, int inclusive)
+{
+    long long rank = 0;
+    int i;
+    
+    for (i = 0; i < set->count; i++)
     {
-        // create a bucket array for digits (0-9) and initialize its contents to 0
-        int bucket[10] = { 0 };
+        if (inclusive && x == INT_MAX)
+            rank += set->runs[i]->count;
+        else
+            rank += lower_bound(set->runs[i]->nums, set->runs[i]->count, inclusive ? x + 1 : x);
+    }
+    
+    return rank;
+}
+
+// adds a sorted run to the set and wakes up the compactor
+void run_set_add(struct run_set * set, struct run * run)
+{
+    pthread_mutex_lock(&set->lock);
+    if (set->count == set->capacity)
+    {
+        set->capacity = set->capacity ? set->capacity * 2 : 16;
+        set->runs = (struct run **)realloc(set->runs, set->capacity * sizeof(struct run *));
+    }
+    set->runs[set->count++] = run;
+    pthread_cond_signal(&set->changed);
+    pthread_mutex_unlock(&set->lock);
+}
+
+// finds a tier holding at least STREAM_TIER_FANOUT runs and returns the index of its first run; -1 if none
+// caller holds the lock
+int run_set_pick(struct run_set * set, int * picked)
+{
+    int i, j;
+    
+    for (i = 0; i < set->count; i++)
+    {
+        int tier = run_tier(set->runs[i]->count);
+        int n = 0;
         
-        // store count of digits of all elements in nums for current radix
-        for (i = 0; i < total; i++)
+        // collect runs of the same tier, in order, starting at run i
+        for (j = i; j < set->count && n < STREAM_TIER_FANOUT; j++)
         {
-            bucket[(nums[i] / exp) % 10]++;
+            if (run_tier(set->runs[j]->count) == tier)
+                picked[n++] = j;
         }
+        if (n == STREAM_TIER_FANOUT)
+            return i;
+    }
+    
+    return -1;
+}
+
+// function used by compactor thread to merge runs of the same size tier into one run
+void * compactor(void * arg)
+{
+    struct run_set * set = (struct run_set *)arg;
+    int picked[STREAM_TIER_FANOUT];         // indexes of runs being merged
+    struct run * inputs[STREAM_TIER_FANOUT];// runs being merged
+    int i, j;
+    
+    pthread_mutex_lock(&set->lock);
+    while (!set->stop)
+    {
+        struct run * merged;
+        int total = 0;
         
-        // add counts of all buckets prior to current bucket to current bucket's count
-        for (i = 1; i < 10; i++)
+        // wait until some tier is full
+        if (run_set_pick(set, picked) < 0)
         {
-            bucket[i] += bucket[i - 1];
+            pthread_cond_wait(&set->changed, &set->lock);
+            continue;
         }
+        for (i = 0; i < STREAM_TIER_FANOUT; i++)
+        {
+            inputs[i] = set->runs[picked[i]];
+            total += inputs[i]->count;
+        }
+        set->merging = 1;
+        pthread_mutex_unlock(&set->lock);
         
-        // going from end to start, insert elements from nums array into radix array sorted by current radix's digit 
-        for (i = total - 1; i >= 0; i--)
+        // merge the runs outside the lock; queries keep reading the unchanged inputs meanwhile
+        merged = (struct run *)malloc(sizeof(struct run));
+        merged->nums = (int *)malloc(total * sizeof(int));
+        merged->count = inputs[0]->count;
+        memcpy(merged->nums, inputs[0]->nums, inputs[0]->count * sizeof(int));
+        for (i = 1; i < STREAM_TIER_FANOUT; i++)
         {
-            radix[--bucket[(nums[i] / exp) % 10]] = nums[i];
+            int * out = (int *)malloc((merged->count + inputs[i]->count) * sizeof(int));
+            merge_int(merged->nums, merged->count, inputs[i]->nums, inputs[i]->count, out);
+            free(merged->nums);
+            merged->nums = out;
+            merged->count += inputs[i]->count;
         }
         
-        // copy all elements from radix array into nums array
-        for (i = 0; i < total; i++)
+        // replace the inputs with the merged run at the position of the first input
+        pthread_mutex_lock(&set->lock);
+        set->runs[picked[0]] = merged;
+        for (i = 1, j = picked[0] + 1; j < set->count; j++)
         {
-            nums[i] = radix[i];
+            if (i < STREAM_TIER_FANOUT && j == picked[i])
+                i++;
+            else
+                set->runs[j - i + 1] = set->runs[j];
         }
+        set->count -= STREAM_TIER_FANOUT - 1;
+        set->merging = 0;
         
-        // increase exponent to update current radix
-        exp *= 10;
+        // no query can still be reading the inputs, since queries hold the lock
+        for (i = 0; i < STREAM_TIER_FANOUT; i++)
+        {
+            free(inputs[i]->nums);
+            free(inputs[i]);
+        }
     }
+    pthread_mutex_unlock(&set->lock);
     
-    // free memory allocated to radix
-    free(radix);
+    return NULL;
 }
 
-// swaps the contents of the specified array using iterative bitonic sort algorithm
-void bitonic_swap(int start, int gap, int spread, int * nums, int mode)
+// sorts a batch of numbers with the local radix kernel and adds it to the set as a new run; a batch with a number
+// outside the range of int, or a token that is not a number, is rejected whole with an error on out (the service
+// never pads with dummies, so INT_MIN is an ordinary value here)
+void stream_ingest(struct run_set * set, char * line, FILE * out)
 {
-    // bitonic swap variables
-    int i, j;                                           // for loop iterators
-    int * newLeft = (int *)malloc(gap * sizeof(int));   // array containing elements in new left swap section
-    int * newRight = (int *)malloc(gap * sizeof(int));  // array containing elements in new right swap section
-    int nl = 0;                                         // current index of new left swap section
-    int nr = 0;                                         // current index of new right swap section
-    
-    // iterate through elements in the specified swap sections of nums array
-    for (i = start, j = start + gap; i < start + spread && j < start + gap + spread; i++, j++)
-    {        
-        // if performing a low swap, insert the lowest elements into newLeft array
-        if (mode == LOW)
-        {
-            // if newLeft array has not yet been filled, insert current element into newLeft array
-            if (nl < spread)
-            {
-                if (nums[i] > nums[j])
-                {
-                    // add current right swap element to newLeft array
-                    newLeft[nl] = nums[j];
-                    
-                    // shift left swap section pointer backward
-                    i--;
-                }
-                else
-                {
-                    // add current left swap element to newLeft array
-                    newLeft[nl] = nums[i];
-                    
-                    // shift right swap section pointer backward
-                    j--;
-                }
-                
-                // increment new left swap section index
-                nl++;
-            }
-            else
-            {
-                if (nums[i] > nums[j])
-                {
-                    // add current right swap element to newRight array
-                    newRight[nr] = nums[j];
-                    
-                    // shift left swap section pointer backward
-                    i--;
-                }
-                else
-                {
-                    // add current left swap element to newRight array
-                    newRight[nr] = nums[i];
-                    
-                    // shift right swap section pointer backward
-                    j--;
-                }
-                
-                // increment new left swap section index
-                nr++;
-            }
+    struct run * run = (struct run *)malloc(sizeof(struct run));
+    int capacity = 64;
+    char * end;
+    
+    run->nums = (int *)malloc(capacity * sizeof(int));
+    run->count = 0;
+    
+    // parse every number in the line
+    for (;;)
+    {
+        long value;
+        const char * error = NULL;
+        
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (*line == '\n' || *line == '\r' || *line == '\0')
+            break;
+        value = strtol(line, &end, 10);
+        
+        // a number must fill its whole token (strchr also finds the terminating NUL)
+        if (end == line || !strchr(" \t\r\n", *end))
+            error = "not a number";
+        else if (value < INT_MIN || value > INT_MAX)
+            error = "number out of range";
+        if (error)
+        {
+            fprintf(out, "ERROR: %s (%.*s), batch rejected\n", error, (int)strcspn(line, " \t\r\n"), line);
+            fflush(out);
+            free(run->nums);
+            free(run);
+            return;
         }
-        else if (mode == HIGH)
+        if (run->count == capacity)
         {
-            // if newRight array has not yet been filled, insert current element into newRight array
-            if (nr < spread)
-            {
-                if (nums[i] > nums[j])
-                {
-                    // add current right swap element to newRight array
-                    newRight[nr] = nums[j];
-                    
-                    // shift left swap section pointer backward
-                    i--;
-                }
-                else
-                {
-                    // add current left swap element to newRight array
-                    newRight[nr] = nums[i];
-                    
-                    // shift right swap section pointer backward
-                    j--;
-                }
-                
-                // increment new left swap section index
-                nr++;
-            }
-            else
-            {
-                if (nums[i] > nums[j])
-                {
-                    // add current right swap element to newLeft array
-                    newLeft[nl] = nums[j];
-                    
-                    // shift left swap section pointer backward
-                    i--;
-                }
-                else
-                {
-                    // add current left swap element to newLeft array
-                    newLeft[nl] = nums[i];
-                    
-                    // shift right swap section pointer backward
-                    j--;
-                }
-                
-                // increment new left swap section index
-                nl++;
-            }
+            capacity *= 2;
+            run->nums = (int *)realloc(run->nums, capacity * sizeof(int));
         }
+        run->nums[run->count++] = (int)value;
+        line = end;
     }
     
-    // insert remaining swap section elements into new right/left swap section depending on mode
-    if (i < start + spread)
+    if (run->count == 0)
     {
-        for (; i < start + spread; i++, nl++, nr++)
+        free(run->nums);
+        free(run);
+        return;
+    }
+    
+    local_sort_int(run->nums, run->count);
+    run_set_add(set, run);
+}
+
+// answers a query about the numbers ingested so far
+void stream_query(struct run_set * set, char * line, FILE * out)
+{
+    char command[16];       // query name
+    long long a, b;         // query arguments
+    int args = sscanf(line, "%15s %lld %lld", command, &a, &b);
+    int i;
+    
+    // nothing parsed leaves command unset, which then names no query
+    if (args < 1)
+        command[0] = '\0';
+    
+    pthread_mutex_lock(&set->lock);
+    if ((strcmp(command, "rank") == 0 || strcmp(command, "count") == 0 || strcmp(command, "range") == 0) &&
+        ((args >= 2 && (a < INT_MIN || a > INT_MAX)) || (args >= 3 && (b < INT_MIN || b > INT_MAX))))
+    {
+        // values are compared as int, so larger arguments would silently wrap
+        fprintf(out, "ERROR: value out of range\n");
+    }
+    else if (strcmp(command, "rank") == 0 && args == 2)
+    {
+        // amount of numbers less than a
+        fprintf(out, "%lld\n", run_set_rank(set, (int)a, 0));
+    }
+    else if (strcmp(command, "count") == 0 && args == 3)
+    {
+        // amount of numbers in [a, b]
+        fprintf(out, "%lld\n", (a > b) ? 0 : run_set_rank(set, (int)b, 1) - run_set_rank(set, (int)a, 0));
+    }
+    else if (strcmp(command, "select") == 0 && args == 2)
+    {
+        // a-th smallest number (from 0), found by binary searching the value whose inclusive rank passes a
+        long long low = INT_MIN;
+        long long high = INT_MAX;
+        
+        if (a < 0 || a >= run_set_rank(set, INT_MAX, 1))
         {
-            if (mode == LOW)
-            {
-                newRight[nr] = nums[i];
-            }
-            else if (mode == HIGH)
+            fprintf(out, "ERROR: rank out of range\n");
+        }
+        else
+        {
+            while (low < high)
             {
-                newLeft[nl] = nums[i];
+                long long mid = low + (high - low) / 2;
+                if (run_set_rank(set, (int)mid, 1) > a)
+                    high = mid;
+                else
+                    low = mid + 1;
             }
+            fprintf(out, "%lld\n", low);
         }
     }
-    else if (j < start + gap + spread)
+    else if (strcmp(command, "range") == 0 && args == 3)
     {
-        for (; j < start + gap + spread; j++, nl++, nr++)
+        // all numbers in [a, b] in sorted order, merged from the matching slice of every run
+        int * found = NULL;
+        int n = 0;
+        
+        for (i = 0; i < set->count && a <= b; i++)
         {
-            if (mode == LOW)
-            {
-                newRight[nr] = nums[j];
-            }
-            else if (mode == HIGH)
+            struct run * run = set->runs[i];
+            int first = lower_bound(run->nums, run->count, (int)a);
+            int last = (b == INT_MAX) ? run->count : lower_bound(run->nums, run->count, (int)b + 1);
+            if (last > first)
             {
-                newLeft[nl] = nums[j];
+                int * out = (int *)malloc((n + last - first) * sizeof(int));
+                merge_int(found, n, &run->nums[first], last - first, out);
+                free(found);
+                found = out;
+                n += last - first;
             }
         }
+        for (i = 0; i < n; i++)
+        {
+            fprintf(out, (i + 1 < n) ? "%d " : "%d", found[i]);
+        }
+        fprintf(out, "\n");
+        free(found);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        // run layout of the set
+        long long total = 0;
+        for (i = 0; i < set->count; i++)
+            total += set->runs[i]->count;
+        fprintf(out, "%lld numbers in %d runs%s:", total, set->count, set->merging ? " (compacting)" : "");
+        for (i = 0; i < set->count; i++)
+            fprintf(out, " %d", set->runs[i]->count);
+        fprintf(out, "\n");
+    }
+    else
+    {
+        fprintf(out, "ERROR: unknown query (use rank <x>, count <lo> <hi>, select <k>, range <lo> <hi>, stats, quit)\n");
+    }
+    pthread_mutex_unlock(&set->lock);
+    fflush(out);
+}
+
+// runs the streaming sort service: reads lines of numbers (batches) and queries from source ("-" for stdin)
+// until "quit" or the end of the input; a named pipe is reopened when its writer closes it so producers can
+// come and go
+void stream_service(char * source)
+{
+    struct run_set set = { 0 };     // sorted runs ingested so far
+    pthread_t tid;                  // compactor thread
+    FILE * in;                      // current input stream
+    struct stat st;                 // status of source
+    int reopen;                     // true if source is a named pipe
+    char * line = NULL;             // current line
+    size_t length = 0;              // allocated length of line
+    int quit = 0;                   // true once quit is read
+    int i;
+    
+    pthread_mutex_init(&set.lock, NULL);
+    pthread_cond_init(&set.changed, NULL);
+    if (pthread_create(&tid, NULL, &compactor, &set) != 0)
+    {
+        fprintf(stderr, "Compactor thread create failed.\n");
+        return;
     }
     
-    // set current left and right swap sections to new left and new right swap sections
-    for (i = start, j = start + gap, nl = 0, nr = 0; nl < spread && nr < spread; i++, j++, nl++, nr++)
-    {        
-        nums[i] = newLeft[nl];
-        nums[j] = newRight[nr];
+    // only a named pipe gets another writer after end of file, a regular file would be replayed forever
+    reopen = strcmp(source, "-") != 0 && stat(source, &st) == 0 && S_ISFIFO(st.st_mode);
+    
+    while (!quit)
+    {
+        in = (strcmp(source, "-") == 0) ? stdin : fopen(source, "r");
+        if (!in)
+        {
+            fprintf(stderr, "Failed to initialize stream input (%s).\n", source);
+            break;
+        }
+        
+        // numeric lines are batches, anything else is a query
+        while (!quit && getline(&line, &length, in) != -1)
+        {
+            char * p = line;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '-' || *p == '+' || (*p >= '0' && *p <= '9'))
+                stream_ingest(&set, p, stdout);
+            else if (strncmp(p, "quit", 4) == 0 && p[4 + strspn(p + 4, " \t\r\n")] == '\0')
+                quit = 1;
+            else if (*p != '\n' && *p != '\0')
+                stream_query(&set, p, stdout);
+        }
+        
+        if (in != stdin)
+            fclose(in);
+        if (!reopen)
+            break;
     }
+    free(line);
     
-    // free memory allocated to newLeft and newRight
-    free(newLeft);
-    free(newRight);
+    // stop compactor and free runs
+    pthread_mutex_lock(&set.lock);
+    set.stop = 1;
+    pthread_cond_signal(&set.changed);
+    pthread_mutex_unlock(&set.lock);
+    pthread_join(tid, NULL);
+    for (i = 0; i < set.count; i++)
+    {
+        free(set.runs[i]->nums);
+        free(set.runs[i]);
+    }
+    free(set.runs);
 }
 
-
 // main routine
 int main(int argc, char ** argv)
 {	
@@ -262,26 +1056,52 @@ int main(int argc, char ** argv)
     int * myTotal = (int *)malloc(sizeof(int)); // amount of numbers to be stored in myNums
     int * myNums;                               // array storing this processor's portion of the list
     int myNumsTotal;                            // amount of numbers to be stored in myNums
+    int * keyRange = (int *)malloc(2 * sizeof(int)); // smallest key and key range for counting sort (range = 0 if unused)
+    unsigned int checksum = 0;                  // checksum of the input list, identifies the checkpoints of this run
     
     // master only variables
-    double startwtime;                          // variable for start timestamp
+    double startwtime = 0.0;                    // variable for start timestamp
     double endwtime;                            // variable for end timestamp
     double totalwtime = 0.0;                    // total time elapsed
     int total;                                  // amount of numbers to be sorted
     int * allNums;                              // array storing all numbers in list (used by root only)
-    int dummy = 0;                              // smallest number that does not exist in number list
+    int dummy = INT_MIN;                        // smallest number, sorted in front of every number in list
     int dummyNums = 0;                          // amount of dummy numbers to be added to number list
     FILE * inFile;                              // input file pointer
     FILE * outFile;                             // output file pointer
+    MPI_Comm localComm;                         // processes on the same host as this process
+    int cpu = -1;                               // cpu this process is pinned to (-1 if not pinned)
 	
 	// initialize MPI with args
     MPI_Init(&argc, &argv);
+    
+    // read options, leaving positional arguments in argv
+    parse_options(&argc, argv);
 	
 	// define this program's rank
 	MPI_Comm_rank(MPI_COMM_WORLD, &progid);
     
     // define number of processors for MPI
 	MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+    
+    // pin this process before any buffers are touched so they are placed on its NUMA node
+    if (pinRanks)
+    {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, progid, MPI_INFO_NULL, &localComm);
+        cpu = pin_process(localComm);
+        MPI_Comm_free(&localComm);
+    }
+    
+    // (master only) run the streaming sort service instead of a single sort
+    if (streamSource)
+    {
+        if (progid == 0)
+        {
+            stream_service(streamSource);
+        }
+        MPI_Finalize();
+        exit(0);
+    }
 	
 	// (master only) variable and file stream initialization
     if (progid == 0)
@@ -317,6 +1137,19 @@ int main(int argc, char ** argv)
             check_error(error);
         }
         
+        // check that restart mode knows where to find checkpoints
+        if (restart && !checkpointDir)
+        {
+            // no checkpoint directory specified
+            fprintf(stderr, "Restart requires a checkpoint directory (--checkpoint <dir>).\n");
+            
+            // set error flag buffer
+            error[0] = 1;
+            
+            // call check_error to close program
+            check_error(error);
+        }
+        
         // if input file is specified, check for successful input file stream initialization
         if (argc > 2 && !inFile)
         {
@@ -380,7 +1213,12 @@ int main(int argc, char ** argv)
         }
         
         // allocate memory for allNums array
-        allNums = (int *)malloc(total * sizeof(int));        
+        allNums = (int *)alloc_local(total * sizeof(int));        
+        if (!allNums)
+        {
+            fprintf(stderr, "Failed to allocate memory for %d numbers.\n", total);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
         
         // insert dummy numbers at front of array
         for (currentIndex = 0; currentIndex < dummyNums; currentIndex++)
@@ -429,6 +1267,35 @@ int main(int argc, char ** argv)
         // calculate myTotal
         myTotal[0] = total / numprocs;
         
+        // checksum the list so a restart only loads checkpoints written for the same input
+        if (checkpointDir)
+        {
+            checksum = checkpoint_checksum(allNums, total);
+        }
+        
+        // find the range of keys in the list (excluding dummies) to detect low-cardinality input
+        keyRange[0] = allNums[dummyNums];
+        keyRange[1] = allNums[dummyNums];
+        for (i = dummyNums + 1; i < total; i++)
+        {
+            if (allNums[i] < keyRange[0])
+                keyRange[0] = allNums[i];
+            if (allNums[i] > keyRange[1])
+                keyRange[1] = allNums[i];
+        }
+        
+        // use counting sort if the key range is small relative to the list, else use bitonic sort
+        if ((long long)keyRange[1] - keyRange[0] + 1 <= COUNT_SORT_MAX_RANGE &&
+            (long long)keyRange[1] - keyRange[0] + 1 <= total)
+        {
+            keyRange[1] = keyRange[1] - keyRange[0] + 1;
+            fprintf(stdout, "Low-cardinality input detected (key range = %d), using counting sort.\n", keyRange[1]);
+        }
+        else
+        {
+            keyRange[1] = 0;
+        }
+        
         // if input file is specified, close input file stream
         if (argc > 2)
         {
@@ -446,11 +1313,58 @@ int main(int argc, char ** argv)
         check_error(error);
     }
     
-    // broadcast myTotal from master to slave process
+    // broadcast myTotal, total, dummyNums and keyRange from master to slave process
     MPI_Bcast(myTotal, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&total, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&dummyNums, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(keyRange, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&checksum, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
     
     // allocate memory for myNums
-    myNums = (int *)malloc(myTotal[0] * sizeof(int));
+    myNums = (int *)alloc_local(myTotal[0] * sizeof(int));
+    if (!myNums)
+    {
+        fprintf(stderr, "Failed to allocate memory for %d numbers (process %d).\n", myTotal[0], progid);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    
+    // report where each process and its buffer were placed
+    if (pinRanks)
+    {
+        report_placement(progid, numprocs, cpu, myNums);
+    }
+    
+    //////////////////////////////
+    //                          //
+    //  COUNTING SORT ROUTINE   //
+    //                          //
+    //////////////////////////////
+    
+    // sort low-cardinality input from key counts, skipping all bitonic iterations
+    if (keyRange[1] > 0)
+    {
+        // scatter parts of allNums array to each process
+        MPI_Scatter(allNums, myTotal[0], MPI_INT, myNums, myTotal[0], MPI_INT, 0, MPI_COMM_WORLD);
+        
+        // (master only) start timer for performance data
+        if (progid == 0)
+        {
+            startwtime = MPI_Wtime();
+        }
+        
+        // build this process's block of the sorted list from the global key counts
+        count_sort(myNums, myTotal[0], progid, dummyNums, dummy, keyRange);
+        
+        // (master only) stop timer for performance data and update totalwtime
+        if (progid == 0)
+        {
+            endwtime = MPI_Wtime();
+            totalwtime += endwtime - startwtime;
+        }
+        
+        // gather myNums arrays into allNums array
+        MPI_Gather(myNums, myTotal[0], MPI_INT, allNums, myTotal[0], MPI_INT, 0, MPI_COMM_WORLD);
+    }
     
     //////////////////////////////
     //                          //
@@ -460,6 +1374,9 @@ int main(int argc, char ** argv)
     
     // global bitonic sort variables
     int gap;                // current displacement between swap sections in the allNums array
+    int startGap;           // gap of the first bitonic iteration to run
+    int round = 0;          // index of current bitonic iteration
+    struct checkpoint_writer writer = { 0 };    // background writer for this process's checkpoints
     
     // master only bitonic sort variables
     int * lowhigh;          // array containing swap instructions for each bitonic iteration
@@ -482,8 +1399,29 @@ int main(int argc, char ** argv)
         }
     }
     
+    // start from the first gap, or from the gap after the last checkpointed round when restarting
+    startGap = total / (numprocs * 2);
+    writer.progid = progid;
+    if (restart && keyRange[1] == 0)
+    {
+        startGap = checkpoint_restart(progid, numprocs, total, dummyNums, checksum, myNums, myTotal[0], &round);
+        
+        // (master only) stop if no round was checkpointed by every process
+        if (progid == 0 && startGap < 0)
+        {
+            fprintf(stderr, "No usable checkpoint found in %s.\n", checkpointDir);
+            error[0] = 1;
+        }
+        check_error(error);
+        
+        // rebuild allNums from the restored blocks and continue with the next round
+        MPI_Gather(myNums, myTotal[0], MPI_INT, allNums, myTotal[0], MPI_INT, 0, MPI_COMM_WORLD);
+        startGap *= 2;
+        round++;
+    }
+    
     // iterative bitonic swapping routine
-    for (gap = total / (numprocs * 2); gap <= total / 2; gap *= 2)
+    for (gap = startGap; gap <= total / 2 && keyRange[1] == 0; gap *= 2, round++)
     {	        	
         // (master only) perform bitonic swapping on allNums array
         if (progid == 0 && gap >= (total / numprocs))
@@ -513,7 +1451,7 @@ int main(int argc, char ** argv)
                     }
                     
                     // perform bitonic swap on current swap sections in allNums array
-                    bitonic_swap(i, swapGap, myTotal[0], allNums, lowhigh[i / (2 * gap)]);
+                    bitonic_swap_int(i, swapGap, myTotal[0], allNums, lowhigh[i / (2 * gap)]);
                 }
                 
                 // update swapGap for next bitonic swap iteration
@@ -538,7 +1476,7 @@ int main(int argc, char ** argv)
         }
 		
         // sort this process's myNums array
-        local_sort(myNums, myTotal[0]);
+        local_sort_int(myNums, myTotal[0]);
         
         // (master only) stop timer for performance data and update totalwtime
         if (progid == 0)
@@ -550,10 +1488,20 @@ int main(int argc, char ** argv)
             totalwtime += endwtime - startwtime;
         }
         
+        // checkpoint this process's block in the background while the exchange continues
+        if (checkpointDir)
+        {
+            checkpoint_round(&writer, round, gap, total, dummyNums, numprocs, checksum, myNums, myTotal[0]);
+        }
+        
         // gather myNums arrays into allNums array
         MPI_Gather(myNums, myTotal[0], MPI_INT, allNums, myTotal[0], MPI_INT, 0, MPI_COMM_WORLD);
     }
     
+    // wait for the last checkpoint to be written
+    checkpoint_wait(&writer);
+    free(writer.nums);
+    
     // (master only) write sorted array to output file and print execution results
     if (progid == 0)
     {
@@ -614,6 +1562,13 @@ int main(int argc, char ** argv)
         check_error(error);
     }
     
+    // free memory allocated to number lists
+    if (progid == 0)
+    {
+        free_local(allNums, total * sizeof(int));
+    }
+    free_local(myNums, myTotal[0] * sizeof(int));
+    
     // call Finalize
     MPI_Finalize();
 	